@@ -20,6 +20,7 @@
 #ifndef ANT_H
 #define ANT_H
 #include "SerialIO.h"
+#include "RingBuffer.h"
 #include "Log.h"
 
 #include <vector>
@@ -29,6 +30,9 @@
 
 #define Max_Data_Size 255
 
+// Longest payload an ANT device sends, extended data included
+#define Max_Message_Length 41
+
 using namespace std;
 
 enum ANT_Message
@@ -78,6 +82,7 @@ enum ANT_Message
     MSG_AGCConfig                           = 0x6A,
     MSG_CrystalEnable                       = 0x6D,
     MSG_ResponseFunc                        = 0x6F,
+    MSG_StartUpMessage                      = 0x6F,
     MSG_ConfigFrequencyAgility              = 0x70,
     MSG_SetProximitySearch                  = 0x71,
     MSG_ReadSEGA                            = 0xA0,
@@ -220,7 +225,91 @@ enum DataPages
     DataPageSubfieldData
 };
 
-extern const useconds_t burstSleepTime;
+extern const unsigned responseTimeout;
+
+// Outstanding command waiting for its answer from the stick. The parse thread
+// completes the oldest request registered for the channel and message id the
+// answer refers to, so several commands can be in flight at the same time.
+// Requests for MSG_ChannelEvent are completed by any channel event listed in
+// events (or by every event if the list is empty), and all of them see it.
+struct ANTRequest
+{
+    uint8_t channel;
+    uint8_t messageId;
+    vector<uint8_t> events;
+    volatile bool completed;
+    uint8_t responseCode;
+};
+
+enum ANTNotification
+{
+    NotifyChannelStatus = 0x01, // value: status reported for the channel
+    NotifyBeacon        = 0x02, // value: client device state of an ANT-FS beacon
+    NotifyResponse      = 0x04  // id: message responded to, value: response or event code
+};
+
+const uint8_t anyChannel = 0xFF;
+
+// Subscriber to channel state, beacon state and response events. Notified
+// from the parse thread as each message is handled, with the ANT state lock
+// held, so it must not call back into ANT.
+class ANTObserver
+{
+public:
+    virtual ~ANTObserver() {}
+    virtual void notify(ANTNotification kind, uint8_t channel, uint8_t id, uint8_t value) = 0;
+};
+
+// Observer that completes on the first notification passing its filters and
+// can be waited for with ANT::wait(). Subscribe it before sending whatever
+// triggers the notification, like a request.
+class ANTFuture : public ANTObserver
+{
+public:
+    ANTFuture(uint8_t channel = anyChannel);
+
+    void accept(ANTNotification kind, const uint8_t values[] = NULL, unsigned count = 0);
+    void notify(ANTNotification kind, uint8_t channel, uint8_t id, uint8_t value);
+
+    volatile bool completed;
+    ANTNotification kind;
+    uint8_t id;
+    uint8_t value;
+
+private:
+    static unsigned filterIndex(ANTNotification kind);
+
+    uint8_t channel;
+    uint8_t kinds;
+    vector<uint8_t> filters[3]; // accepted values per kind, empty for any
+};
+
+// Receives burst payload from the parse thread as packets arrive, so large
+// transfers can be placed in their final buffer without intermediate copies.
+// Only the contiguous start of a burst is delivered: packets after a
+// sequence gap are dropped. Called with the ANT state lock held.
+class ANTBurstSink
+{
+public:
+    virtual ~ANTBurstSink() {}
+    virtual void burstReceived(const uint8_t *data, size_t len) = 0;
+};
+
+// Everything a channel is opened with, sent to the stick in one go
+struct ANTChannelProfile
+{
+    uint8_t network;
+    vector<uint8_t> networkKey;
+    ChannelType type;
+    uint16_t period;
+    uint8_t searchTimeout;
+    uint8_t frequency;
+    uint16_t searchWaveform; // 0 keeps the stick's default
+    uint16_t deviceNum;
+    bool pairing;
+    uint8_t deviceType;
+    uint8_t transmissionType;
+};
 
 class ANTMessage
 {
@@ -232,43 +321,115 @@ public:
     };
 
     static bool sendMessage(SerialIO &sio, ANT_Message messageId, vector<uint8_t>& messageData);
-    static bool getMessage(vector<uint8_t> &receivedData, volatile ANT_Message &messageId, vector<uint8_t> &messageData);
 
 private:
     static uint8_t calculateCRC(vector<uint8_t> &buffer);
 };
 
-class ANT
+struct ANTDecoderStatistics
+{
+    unsigned long frames;
+    unsigned long discardedBytes;
+    unsigned long checksumErrors;
+    unsigned long lengthErrors;
+    unsigned long shortMessages;
+};
+
+// Incremental frame decoder: raw bytes from the serial port are pushed through
+// a sync -> length -> id -> data -> checksum state machine, so frames split
+// over several reads are reassembled without buffering or shifting the input.
+// A frame with a bad checksum is dropped and the bytes following its sync byte
+// are scanned again for the next TXSync/RXSync, so the decoder resynchronizes
+// on its own after line noise. A length above Max_Message_Length cannot be a
+// real frame and is treated the same way without waiting for its data.
+class ANTMessageDecoder
+{
+public:
+    enum Result
+    {
+        DecodeIncomplete,
+        DecodeComplete,
+        DecodeBadChecksum,
+        DecodeBadLength
+    };
+
+    ANTMessageDecoder();
+
+    void reset();
+    Result decode(const uint8_t *data, size_t len, size_t &consumed);
+
+    ANT_Message getMessageId() const;
+    const uint8_t *getMessageData() const;
+    uint8_t getMessageLength() const;
+    ANTDecoderStatistics getStatistics() const;
+
+private:
+    enum State
+    {
+        StateSync,
+        StateLength,
+        StateId,
+        StateData,
+        StateChecksum
+    };
+
+    enum
+    {
+        MaxFrameSize = Max_Message_Length + 4
+    };
+
+    void discardFrame();
+
+    State state;
+    uint8_t crc;
+    uint8_t messageLength;
+    unsigned frameIndex;
+    uint8_t frame[MaxFrameSize];
+    unsigned replayPos;
+    unsigned replayLen;
+    uint8_t replay[MaxFrameSize];
+    ANTDecoderStatistics statistics;
+};
+
+class ANT : public SerialListener
 {
 public:
     ANT();
     ~ANT();
 
-    bool init(string deviceName, speed_t speed);
+    bool init(string deviceName, speed_t speed, SerialReactor *sharedReactor = NULL);
     void leave();
     bool receiveBuffer();
+    bool serialDataReceived(SerialIO &sio);
+    bool serialTimeout(SerialIO &sio);
+    void serialClosed(SerialIO &sio);
     static void* receiveThread(ANT* ant);
     bool parseMessage();
+    void handleMessage(ANT_Message id, const uint8_t *msgData, uint8_t msgLength);
     static void* parseThread(ANT* ant);
-    bool waitMessage(uint8_t id);
-    bool waitResponse(uint8_t id);
+    bool waitStateChange();
     bool waitBroadcast();
     bool waitBurst(vector<uint8_t> &data);
     bool waitBurst(uint8_t data[], unsigned len);
+    bool waitBurst(ANTBurstSink &sink);
+    void addRequest(ANTRequest &request, uint8_t channel, uint8_t id);
+    void addEventRequest(ANTRequest &request, uint8_t channel, const uint8_t events[], unsigned count);
+    void removeRequest(ANTRequest &request);
+    bool sendRequest(ANTRequest &request, ANT_Message id, vector<uint8_t> &data);
+    bool waitRequest(ANTRequest &request, unsigned timeout = responseTimeout);
+    bool waitEvent(ANTRequest &request, unsigned timeout);
+    bool waitMessage(ANTRequest &answer, ANTRequest &refusal, unsigned timeout = responseTimeout);
+    void subscribe(ANTObserver &observer);
+    void unsubscribe(ANTObserver &observer);
+    bool wait(ANTFuture &future, unsigned timeout);
     bool getChannelStatus(uint8_t &status);
+    bool waitChannelStatus(uint8_t channel, uint8_t status, unsigned timeout = responseTimeout);
     string getChannelStatusString();
+    ANTDecoderStatistics getDecoderStatistics();
 
     // ANT commands
     bool resetSystem();
-    bool setNetworkKey(uint8_t network, vector<uint8_t> &key);
-    bool assignChannel(uint8_t channel, ChannelType type, uint8_t network);
-    bool setChannelPeriod(uint8_t channel, uint16_t period);
-    bool setChannelSearchTimeout(uint8_t channel, uint8_t timeout);
-    bool setChannelRFFreq(uint8_t channel, uint8_t frequency);
-    bool setSearchWaveform(uint8_t channel, uint16_t waveform);
-    bool setChannelId(uint8_t channel, uint16_t deviceNum, bool pairing,
-        uint8_t deviceType, uint8_t transmissionType);
-    bool openChannel(uint8_t channel);
+    bool openChannel(uint8_t channel, const ANTChannelProfile &profile);
     bool requestMessage(uint8_t channel, ANT_Message msgId);
     bool sendAcknowledgedData(uint8_t channel, vector<uint8_t> &ackData);
     bool sendAcknowledgedData(uint8_t channel, uint8_t data[], unsigned len);
@@ -276,20 +437,40 @@ public:
     bool sendBurstTransferData(uint8_t channel, uint8_t data[], unsigned len);
 
 protected:
+    typedef multimap<uint16_t, ANTRequest*> RequestMap;
+
+    static uint16_t requestKey(uint8_t channel, uint8_t id);
+    void insertEventRequest(ANTRequest &request, uint8_t channel, const uint8_t events[], unsigned count);
+    bool requestCompleted(ANTRequest &request, uint8_t &code);
+    void eraseRequest(ANTRequest &request);
+    void completeRequest(uint8_t channel, uint8_t id, uint8_t code);
+    void completeEvent(uint8_t channel, uint8_t code);
+    void notifyObservers(ANTNotification kind, uint8_t channel, uint8_t id, uint8_t value);
+    bool waitLastBurst();
+    void consumeBurst();
+
     SerialIO sio;
+    SerialReactor ownReactor;
+    SerialReactor *reactor;
     pthread_t receiveThreadHandle;
     pthread_t parseThreadHandle;
-    static volatile bool leaveFlag;
-    volatile ANT_Message messageId;
-    volatile uint8_t responseId;
-    volatile uint8_t responseCode;
+    volatile bool leaveFlag;
     volatile uint8_t channelStatus;
     volatile uint8_t clientDeviceState;
-    volatile bool broadcast;
     volatile bool lastBurst;
-    vector<uint8_t> receivedData;
-    pthread_mutex_t receivedDataMutex;
+    bool burstFailed;
+    uint8_t burstSequence;
+    bool burstGap;
+    RingBuffer receivedData;
+    int receivedDataEvent;
+    pthread_mutex_t stateMutex;
+    pthread_cond_t stateCond;
+    ANTMessageDecoder decoder;
     vector<uint8_t> burstData;
+    ANTBurstSink *burstSink;
+    RequestMap pendingRequests;
+    vector<ANTObserver*> observers;
+    unsigned long shortMessages;
     
 public:
     map<uint8_t,string> responseIdMap;
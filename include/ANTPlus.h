@@ -189,6 +189,35 @@ struct ANTPlusDownloadFooter
 
 #pragma pack()
 
+// One burst answer to a download request. Header and footer are assembled in
+// place; the payload is written straight into the file buffer at its data
+// offset, which is grown to the announced file size on the first block.
+class ANTPlusDownloadBlock : public ANTBurstSink
+{
+public:
+    ANTPlusDownloadBlock(vector<uint8_t> &file);
+
+    void burstReceived(const uint8_t *data, size_t len);
+    size_t size() const { return received; }
+    size_t dataReceived() const;
+
+    ANTPlusDownloadHeader header;
+    ANTPlusDownloadFooter footer;
+
+private:
+    vector<uint8_t> &file;
+    size_t received;
+};
+
+// Sees the payload of a file in order while it is being downloaded, so it
+// can be processed before the transfer has finished.
+class ANTPlusDownloadListener
+{
+public:
+    virtual ~ANTPlusDownloadListener() {}
+    virtual void downloadData(const uint8_t *data, size_t len) = 0;
+};
+
 class ANTPlus : public ANT
 {
 public:
@@ -201,10 +230,21 @@ public:
     bool requestSN(uint8_t channel, uint32_t hostSN, string& unitName, uint32_t& unitId);
     bool devicePair(uint8_t channel, uint32_t hostSN, string pcName, uint32_t& unitId, uint64_t& key);
     bool authenticate(uint8_t channel, uint32_t hostSN, uint64_t key);
-    bool download(uint8_t channel, uint16_t file, vector<uint8_t> &data);
+    bool download(uint8_t channel, uint16_t file, vector<uint8_t> &data, uint32_t timeStamp = 0, uint32_t directorySize = 0, ANTPlusDownloadListener *listener = NULL);
+    bool downloadHead(uint8_t channel, uint16_t file, uint32_t length, vector<uint8_t> &data);
+    bool downloadTail(uint8_t channel, uint16_t file, vector<uint8_t> &data, uint32_t timeStamp = 0, uint32_t directorySize = 0, ANTPlusDownloadListener *listener = NULL);
+    void setCheckpointDirectory(const string &directory);
 
 private:
+    bool sendCommand(uint8_t channel, uint8_t data[], unsigned len);
+    bool downloadRange(uint8_t channel, uint16_t file, vector<uint8_t> &data, uint32_t timeStamp, uint32_t directorySize, ANTPlusDownloadListener *listener, uint32_t length);
+    void adaptBlockSize(bool burstComplete);
+
     int maxAttempts;
+    uint32_t blockSize;
+    uint32_t blockSizeThreshold;
+    uint32_t currentUnitId;
+    string checkpointDirectory;
     map<uint8_t, string> downloadResponseCodesMap;
 };
 
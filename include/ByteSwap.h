@@ -0,0 +1,57 @@
+/***************************************************************************
+ *   Copyright (C) 2010-2012 by Oleg Khudyakov                             *
+ *   prcoder@gmail.com                                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+#ifndef BYTE_SWAP_H
+#define BYTE_SWAP_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <vector>
+
+using namespace std;
+
+// Byte order conversion of fixed-layout records, e.g. FIT data messages
+// written in the other byte order. The plan is built once from the element
+// size of every field, finished, and then reorders whole records, 16 bytes per shuffle
+// on processors with SSSE3 and byte by byte elsewhere.
+class ByteSwapPlan
+{
+public:
+    ByteSwapPlan();
+
+    void clear();
+    void addField(size_t size, size_t elementSize);
+    void finish();
+    size_t size() const;
+    bool swaps() const;
+    void apply(const uint8_t *in, uint8_t *out) const;
+
+private:
+    enum
+    {
+        BlockSize = 16
+    };
+
+    vector<uint16_t> source; // input byte for every output byte
+    vector<uint8_t> masks; // shuffle mask per block, if the block stays within itself
+    vector<uint8_t> inBlock;
+    bool swapping;
+};
+
+#endif
@@ -0,0 +1,36 @@
+/***************************************************************************
+ *   Copyright (C) 2010-2012 by Oleg Khudyakov                             *
+ *   prcoder@gmail.com                                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+#ifndef CRC16_H
+#define CRC16_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// CRC-16 used by FIT files and ANT-FS transfers (CRC-16/ARC, reflected
+// polynomial 0xA001, initial value 0). update() continues a running CRC, so
+// data can be fed in consecutive chunks as it arrives.
+class CRC16
+{
+public:
+    static uint16_t update(uint16_t crc, uint8_t byte);
+    static uint16_t update(uint16_t crc, const uint8_t *data, size_t len);
+};
+
+#endif
@@ -0,0 +1,98 @@
+/***************************************************************************
+ *   Copyright (C) 2010-2012 by Oleg Khudyakov                             *
+ *   prcoder@gmail.com                                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+class ZeroFileContent;
+
+// A file as the watch lists it in its directory. File indices are reused
+// once the watch deletes files, so an index alone does not identify a file.
+struct CatalogEntry
+{
+    uint32_t unitId;
+    uint16_t fileIndex;
+    uint32_t timeStamp;
+    uint32_t fileSize;
+
+    bool operator==(const CatalogEntry &other) const
+    {
+        return unitId == other.unitId && fileIndex == other.fileIndex &&
+            timeStamp == other.timeStamp && fileSize == other.fileSize;
+    }
+};
+
+struct CatalogEntryHash
+{
+    size_t operator()(const CatalogEntry &entry) const
+    {
+        uint64_t key = ((uint64_t)entry.unitId << 32) ^ ((uint64_t)entry.fileIndex << 16) ^
+            ((uint64_t)entry.timeStamp * 0x9E3779B97F4A7C15ULL) ^ entry.fileSize;
+        return (size_t)(key ^ (key >> 29));
+    }
+};
+
+// Files already synced from any watch, kept on disk as one line per file,
+// plus the directory modification time of each watch as of its last
+// complete sync. Each file is stored with the CRC of its content, so a
+// file that grew since can be checked against the copy kept locally and
+// only its tail downloaded. Lookups are hash-based. Additions are collected and
+// written out in batches, each time by replacing the whole file
+// atomically. The catalog can be shared between threads.
+class Catalog
+{
+public:
+    Catalog(const string &fileName, size_t batchSize = 16);
+    ~Catalog();
+
+    bool load();
+    size_t size();
+    bool contains(const CatalogEntry &entry);
+    void add(const CatalogEntry &entry, uint16_t crc = 0);
+    bool previous(uint32_t unitId, uint16_t fileIndex, CatalogEntry &entry, uint16_t &crc);
+    bool directoryTime(uint32_t unitId, uint32_t &modifiedTime);
+    void setDirectoryTime(uint32_t unitId, uint32_t modifiedTime);
+    bool commit();
+    void importLegacy(const string &legacyFileName, uint32_t unitId, ZeroFileContent &directory);
+
+private:
+    Catalog(const Catalog &);
+    Catalog &operator=(const Catalog &);
+
+    bool write();
+    bool insert(const CatalogEntry &entry, uint16_t crc);
+
+    string fileName;
+    size_t batchSize;
+    size_t pending;
+    unordered_map<CatalogEntry, uint16_t, CatalogEntryHash> entries;
+    unordered_map<uint64_t, CatalogEntry> latest;
+    unordered_map<uint32_t, uint32_t> directoryTimes;
+    pthread_mutex_t mutex;
+};
+
+#endif
@@ -0,0 +1,50 @@
+/***************************************************************************
+ *   Copyright (C) 2010-2012 by Oleg Khudyakov                             *
+ *   prcoder@gmail.com                                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+#ifndef DOWNLOAD_CHECKPOINT_H
+#define DOWNLOAD_CHECKPOINT_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// On-disk state of an interrupted ANT-FS download: the payload received so
+// far (.part) and what is needed to continue the download request from its
+// end (.resume). A checkpoint only applies to the same unit, file index,
+// directory timestamp and directory file size it was taken for.
+class DownloadCheckpoint
+{
+public:
+    DownloadCheckpoint(const string &directory, uint32_t unitId, uint16_t fileIndex, uint32_t timeStamp, uint32_t fileSize);
+
+    bool load(vector<uint8_t> &data, uint32_t &offset, uint16_t &CRCseed);
+    bool save(const vector<uint8_t> &data, uint32_t from, uint32_t offset, uint16_t CRCseed);
+    void remove();
+
+private:
+    string partName;
+    string resumeName;
+    uint16_t fileIndex;
+    uint32_t timeStamp;
+    uint32_t fileSize;
+};
+
+#endif
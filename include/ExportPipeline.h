@@ -0,0 +1,99 @@
+/***************************************************************************
+ *   Copyright (C) 2010-2012 by Oleg Khudyakov                             *
+ *   prcoder@gmail.com                                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+#ifndef EXPORT_PIPELINE_H
+#define EXPORT_PIPELINE_H
+
+#include "ANTPlus.h"
+#include "Catalog.h"
+#include "FIT.h"
+#include "GPX.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <deque>
+#include <fstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Decodes an activity block by block while it is being downloaded
+class ActivityParser : public ANTPlusDownloadListener
+{
+public:
+    ActivityParser(FIT &fit);
+
+    void downloadData(const uint8_t *data, size_t len);
+    bool finish();
+    size_t decodedSize() const { return decoder.decodedSize(); }
+
+    GPX gpx;
+
+private:
+    FITDecoder decoder;
+    bool failed;
+};
+
+struct ExportJob
+{
+    CatalogEntry entry;
+    uint16_t crc;
+    GPX gpx;
+    vector<uint8_t> raw;
+};
+
+// Writes parsed activities out as GPX on worker threads while the ANT
+// session goes on downloading. push() blocks while the queue is full, which
+// bounds the memory held by tracks waiting for a worker. Exported files are
+// added to the catalog. The raw content of files the watch appends to is
+// archived as well, so that a later sync only needs what was added.
+class ExportPipeline
+{
+public:
+    ExportPipeline(Catalog &catalog, size_t capacity, unsigned workers);
+    ~ExportPipeline();
+
+    bool start();
+    void push(const CatalogEntry &entry, GPX &gpx, uint16_t crc = 0, vector<uint8_t> *raw = NULL);
+    void finish();
+
+    static bool loadArchive(const CatalogEntry &entry, uint16_t crc, vector<uint8_t> &data);
+
+private:
+    ExportPipeline(const ExportPipeline &);
+    ExportPipeline &operator=(const ExportPipeline &);
+
+    static void* workerThread(ExportPipeline *pipeline);
+    bool pop(ExportJob &job);
+    void process(ExportJob &job);
+    static string archiveName(const CatalogEntry &entry);
+
+    size_t capacity;
+    unsigned workers;
+    vector<pthread_t> threads;
+    deque<ExportJob> jobs;
+    bool finishing;
+    pthread_mutex_t mutex;
+    pthread_cond_t jobAvailable;
+    pthread_cond_t spaceAvailable;
+    Catalog &catalog;
+};
+
+#endif
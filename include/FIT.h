@@ -21,6 +21,7 @@
 #ifndef FIT_H
 #define FIT_H
 
+#include "ByteSwap.h"
 #include "GPX.h"
 #include "Log.h"
 
@@ -64,6 +65,12 @@ union RecordHeader
     RecordCompressedTimeStampHeader ctsHeader;
 };
 
+enum Architectures
+{
+    ArchitectureLittleEndian = 0,
+    ArchitectureBigEndian = 1
+};
+
 struct RecordFixed
 {
     uint8_t reserved;
@@ -143,12 +150,80 @@ enum BaseTypes
     BT_ByteArray
 };
 
+// Where a decoded field goes
+enum DecodeColumn
+{
+    ColumnFileType,
+    ColumnFileCreationTime,
+    ColumnPointTime,
+    ColumnPointLatitude,
+    ColumnPointLongitude,
+    ColumnPointAltitude,
+    ColumnPointHeartRate,
+    ColumnPointCadence,
+    ColumnWayPointTime,
+    ColumnWayPointName,
+    ColumnWayPointLatitude,
+    ColumnWayPointLongitude,
+    ColumnWayPointAltitude,
+    ColumnCourseName,
+    ColumnTimeStamp, // only kept as the base for compressed timestamps
+    ColumnLog
+};
+
+// Field number of the timestamp in every message
+const uint8_t timeStampField = 253;
+
+// How a field's bytes are read into a value; ConvertNone leaves them to the
+// column (strings, logged fields)
+enum DecodeConverter
+{
+    ConvertNone = 0,
+    ConvertInt8,
+    ConvertUInt8,
+    ConvertUInt16,
+    ConvertInt32,
+    ConvertUInt32
+};
+
+struct DecodeOp
+{
+    uint16_t offset;
+    uint8_t width;
+    uint8_t column;
+    uint8_t converter;
+    uint8_t definitionNum;
+    uint8_t baseType;
+};
+
+// A definition message compiled into the few field reads its data messages
+// need. Fields the decoder has no use for and unknown messages have no ops,
+// length covers them all.
+struct DecodePlan
+{
+    uint16_t globalNum;
+    uint32_t length;
+    uint8_t timeColumn;
+    vector<DecodeOp> ops;
+    ByteSwapPlan byteOrder; // from the record's architecture to the host's
+};
+
+// Plans are shared by every definition with the same layout, across files
+// and decoders; ownPlan is only used once the shared cache is full.
 struct RecordDef
 {
+    RecordDef() : plan(NULL), length(0), defined(false) {}
+
     RecordFixed rfx;
-    vector<RecordField> rf;
+    const DecodePlan *plan;
+    DecodePlan ownPlan;
+    uint32_t length; // payload bytes of a data message
+    bool defined;
 };
 
+// Number of local message types a record header can address
+const unsigned localMessageTypes = 16;
+
 enum MessageFieldTypes
 {
     MessageFieldTypeUnknown = 0,
@@ -256,9 +331,11 @@ enum GarminProducts
 class ZeroFileContent
 {
 public:
-    vector<uint8_t> activityFiles;
-    vector<uint8_t> waypointsFiles;
-    vector<uint8_t> courseFiles;
+    DirectoryHeader header;
+    vector<uint16_t> activityFiles;
+    vector<uint16_t> waypointsFiles;
+    vector<uint16_t> courseFiles;
+    map<uint16_t, ZeroFileRecord> records;
 };
 
 class FIT
@@ -268,11 +345,17 @@ public:
     ~FIT();
 
     uint16_t CRC_byte(uint16_t crc, uint8_t byte);
-    string getDataString(uint8_t *ptr, uint8_t size, uint8_t baseType, uint8_t messageType, uint8_t fieldNum);
-    bool parse(vector<uint8_t> &fitData, GPX &gpx);
+    string getDataString(const uint8_t *ptr, uint8_t size, uint8_t baseType, uint8_t messageType, uint8_t fieldNum);
+    bool parse(const uint8_t *fitData, size_t len, GPX &gpx);
+    bool parse(const vector<uint8_t> &fitData, GPX &gpx);
     bool parseZeroFile(vector<uint8_t> &data, ZeroFileContent &zeroFileContent);
 
 private:
+    friend class FITDecoder;
+    void decodeDefinition(const uint8_t *ptr, RecordDef &rd);
+    static void compilePlan(const RecordFixed &rfx, const RecordField *fields, DecodePlan &plan);
+    bool decodeData(const uint8_t *ptr, const DecodePlan &plan, GPX &gpx, uint32_t &timeStamp, bool compressedTime);
+
     map<uint8_t, string> messageTypeMap;
     map<uint8_t, map<uint8_t, string> > messageFieldNameMap;
     map<uint8_t, map<uint8_t, uint8_t> > messageFieldTypeMap;
@@ -283,4 +366,49 @@ private:
     int16_t manufacturer;
 };
 
+// Push-style FIT decoder. Data can be fed in chunks of any size as it
+// arrives, e.g. block by block during a download; complete records are
+// decoded in place and only a record split across chunks is carried over.
+// Definitions and the running CRC persist between chunks. Each local
+// message type has a fixed definition slot, so data messages are decoded
+// without lookups or allocations. Chained FIT files, one following the CRC
+// of another, are decoded one after the other.
+class FITDecoder
+{
+public:
+    FITDecoder(FIT &fit, GPX &gpx);
+
+    bool feed(const uint8_t *data, size_t len);
+    bool finish();
+
+    // Bytes making up complete, CRC checked FIT files so far
+    size_t decodedSize() const { return decoded; }
+
+private:
+    enum State
+    {
+        StateHeader,
+        StateRecords,
+        StateCRC,
+        StateDone,
+        StateError
+    };
+
+    size_t unitLength(const uint8_t *ptr, size_t len);
+    void process(const uint8_t *ptr, size_t length);
+    const uint8_t *hostOrder(const uint8_t *payload, const DecodePlan &plan);
+
+    FIT &fit;
+    GPX &gpx;
+    State state;
+    uint32_t dataRemaining;
+    uint16_t crc;
+    size_t consumed;
+    size_t decoded;
+    uint32_t timeStamp; // last full or compressed timestamp
+    vector<uint8_t> carry;
+    vector<uint8_t> swapped;
+    RecordDef recDefs[localMessageTypes];
+};
+
 #endif
@@ -39,7 +39,7 @@ public:
     static string gmTime(uint32_t time);
     static string localTime(uint32_t time);
     static string gTime(uint32_t time);
-    static string gString(uint8_t *str, int maxSize);
+    static string gString(const uint8_t *str, int maxSize);
     static string gHex(uint8_t *buf, int size);
     static string gHex(vector<uint8_t> &buf);
     static string hexDump(vector<uint8_t> &buf);
@@ -24,11 +24,14 @@
 
 using namespace std;
 
-extern ostringstream logStream;
+// Each thread collects its own log line; flushing writes it out whole
+extern thread_local ostringstream logStream;
 void logFlush();
 void logPush();
 
-extern ostringstream parseThreadLogStream;
+// Written by every parse thread and by senders on any thread, so each
+// thread collects its own line
+extern thread_local ostringstream parseThreadLogStream;
 void parseThreadLogFlush();
 
 #endif
@@ -0,0 +1,51 @@
+/***************************************************************************
+ *   Copyright (C) 2010-2012 by Oleg Khudyakov                             *
+ *   prcoder@gmail.com                                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// Preallocated single-producer/single-consumer byte ring. The producer writes
+// straight into the free space and publishes it with commit(), the consumer
+// reads the filled space in place and releases it with consume(). Each index
+// is only ever written by one side, so neither side needs a lock.
+class RingBuffer
+{
+public:
+    RingBuffer(size_t capacity);
+    ~RingBuffer();
+
+    size_t writable(uint8_t *&ptr);
+    void commit(size_t len);
+    size_t readable(const uint8_t *&ptr);
+    void consume(size_t len);
+
+private:
+    RingBuffer(const RingBuffer &);
+    RingBuffer &operator=(const RingBuffer &);
+
+    uint8_t *buffer;
+    size_t size;
+    size_t head;    // written by the producer only
+    size_t tail;    // written by the consumer only
+};
+
+#endif
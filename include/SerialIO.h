@@ -23,11 +23,24 @@
 #include <stdlib.h>
 #include <termios.h>
 #include <stdint.h>
+#include <pthread.h>
 #include <string>
 #include <vector>
+#include <deque>
+#include <map>
+
+#include "RingBuffer.h"
 
 using namespace std;
 
+class SerialReactor;
+
+// Outgoing frames are queued and written without blocking; frames that queue
+// up while the port is busy are coalesced into a single writev() by the
+// reactor thread. drain() is the explicit barrier that waits until everything
+// queued has left the UART. When the receive ring fills up the device is no
+// longer watched for input, leaving the bytes in the kernel until the
+// consumer calls resumeReceive() after freeing space.
 class SerialIO
 {
 public:
@@ -37,14 +50,78 @@ public:
     bool open(string deviceName, speed_t speed);
     void close();
     bool receiveBuffer(vector<uint8_t> &buffer);
+    bool receiveBuffer(RingBuffer &ring);
+    bool receiveBuffer(uint8_t *buffer, size_t &len);
+    void resumeReceive();
     bool sendBuffer(vector<uint8_t> &buffer);
+    bool flush(int milliseconds = 1000);
+    bool drain(int milliseconds = 1000);
 
 private:
-    bool receiveBuffer(uint8_t *buffer, size_t &len);
-    
+    size_t pendingBytes();
+    bool writeQueue();
+    void waitWritable(int milliseconds);
+    void watchWritable();
+    void watchEvents();
+
+    friend class SerialReactor;
+
 private:
     int fd;
     int timeout;
+    SerialReactor *reactor;
+    pthread_mutex_t txMutex;
+    deque<vector<uint8_t> > txQueue;
+    size_t txOffset;
+    pthread_mutex_t watchMutex;
+    bool txWatched;
+    volatile bool rxPaused;
+};
+
+// Receives the events of a SerialIO registered with a SerialReactor. Returning
+// false removes the device from the reactor; serialClosed() is called whenever
+// the reactor drops a device, including on hangup and read errors.
+class SerialListener
+{
+public:
+    virtual ~SerialListener() {}
+
+    virtual bool serialDataReceived(SerialIO &sio) = 0;
+    virtual bool serialTimeout(SerialIO &sio) = 0;
+    virtual void serialClosed(SerialIO &sio) = 0;
+};
+
+// epoll based event loop: a single thread calling run() services any number of
+// serial devices. A device that stays silent longer than its timeout is
+// reported to its listener as an event rather than as a read error.
+class SerialReactor
+{
+public:
+    SerialReactor();
+    ~SerialReactor();
+
+    bool open();
+    void close();
+    bool add(SerialIO &sio, SerialListener *listener);
+    void remove(SerialIO &sio);
+    void watch(SerialIO &sio, bool readable, bool writable);
+    bool run(int timeout);
+
+private:
+    struct Registration
+    {
+        SerialIO *sio;
+        SerialListener *listener;
+        uint64_t lastActivity;
+    };
+
+    static uint64_t now();
+    void erase(int fd);
+    void drop(int fd);
+
+    int epollFd;
+    pthread_mutex_t mutex;
+    map<int, Registration> registrations;
 };
 
 #endif
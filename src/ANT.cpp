@@ -26,14 +26,81 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <iostream>
 #include <sstream>
 #include <iomanip>
+#include <algorithm>
 
 using namespace std;
 
-const useconds_t sleepTime = 15000;
-const useconds_t burstSleepTime = 60000;
+const unsigned waitTick = 100; // ms between leaveFlag checks while waiting for an event
+const unsigned responseTimeout = 2000; // ms
+const size_t receiveBufferSize = 65536;
+const unsigned burstStartTimeout = 2000; // ms, a burst starts with the next channel period
+const unsigned burstTimeout = 10000; // ms
+const unsigned startUpTimeout = 1000; // ms
+const unsigned channelStatusPoll = 50; // ms between status requests while waiting for a state
+const unsigned beaconTimeout = 10000; // ms, beacons come at least every 2 s
+
+static void waitDeadline(struct timespec &deadline, unsigned milliseconds)
+{
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += milliseconds / 1000;
+    deadline.tv_nsec += (milliseconds % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+}
+
+ANTFuture::ANTFuture(uint8_t channel) :
+    completed(false),
+    kind(NotifyResponse),
+    id(0),
+    value(0),
+    channel(channel),
+    kinds(0)
+{
+}
+
+unsigned ANTFuture::filterIndex(ANTNotification kind)
+{
+    switch (kind)
+    {
+        case NotifyChannelStatus: return 0;
+        case NotifyBeacon: return 1;
+        default: return 2;
+    }
+}
+
+void ANTFuture::accept(ANTNotification kind, const uint8_t values[], unsigned count)
+{
+    kinds |= kind;
+    filters[filterIndex(kind)].assign(values, values + count);
+}
+
+void ANTFuture::notify(ANTNotification kind, uint8_t channel, uint8_t id, uint8_t value)
+{
+    if (completed || !(kinds & kind) || (this->channel != anyChannel && this->channel != channel))
+    {
+        return;
+    }
+
+    const vector<uint8_t> &filter = filters[filterIndex(kind)];
+    if (!filter.empty() && find(filter.begin(), filter.end(), value) == filter.end())
+    {
+        return;
+    }
+
+    this->kind = kind;
+    this->id = id;
+    this->value = value;
+    completed = true;
+}
 
 bool ANTMessage::sendMessage(SerialIO &sio, ANT_Message messageId, vector<uint8_t>& messageData)
 {
@@ -55,51 +122,141 @@ bool ANTMessage::sendMessage(SerialIO &sio, ANT_Message messageId, vector<uint8_
     return sio.sendBuffer(buffer);
 }
 
-bool ANTMessage::getMessage(vector<uint8_t> &receivedData, volatile ANT_Message &messageId, vector<uint8_t> &messageData)
+ANTMessageDecoder::ANTMessageDecoder()
+{
+    reset();
+}
+
+void ANTMessageDecoder::reset()
 {
-    size_t index = 0;
-    for (index = 0; index < receivedData.size(); index++)
+    state = StateSync;
+    crc = 0;
+    messageLength = 0;
+    frameIndex = 0;
+    replayPos = 0;
+    replayLen = 0;
+    memset(&statistics, 0, sizeof(statistics));
+}
+
+ANTMessageDecoder::Result ANTMessageDecoder::decode(const uint8_t *data, size_t len, size_t &consumed)
+{
+    consumed = 0;
+    for (;;)
     {
-        if (receivedData[index] == TXSync)
+        // Bytes of a dropped frame are scanned again before any new input
+        uint8_t byte;
+        if (replayPos < replayLen)
+        {
+            byte = replay[replayPos++];
+        }
+        else if (consumed < len)
+        {
+            byte = data[consumed++];
+        }
+        else
         {
             break;
         }
-    }
-    if (index == receivedData.size())
-    {
-        parseThreadLogStream << "Sync byte (0x" << hex << (uint8_t)TXSync << ") not found";
-        parseThreadLogFlush();
-        return false;
-    }
-    
-    vector<uint8_t> buffer;
 
-    uint8_t sync = receivedData[index++];
-    buffer.push_back(sync);
+        switch (state)
+        {
+            case StateSync:
+            {
+                if (byte == ANTMessage::TXSync || byte == ANTMessage::RXSync)
+                {
+                    frame[0] = byte;
+                    frameIndex = 1;
+                    crc = byte;
+                    state = StateLength;
+                }
+                else
+                {
+                    statistics.discardedBytes++;
+                }
+                break;
+            }
+            case StateLength:
+            {
+                frame[frameIndex++] = byte;
+                crc ^= byte;
+                messageLength = byte;
+                state = StateId;
+                if (messageLength > Max_Message_Length)
+                {
+                    state = StateSync;
+                    statistics.lengthErrors++;
+                    discardFrame();
+                    return DecodeBadLength;
+                }
+                break;
+            }
+            case StateId:
+            {
+                frame[frameIndex++] = byte;
+                crc ^= byte;
+                state = (messageLength > 0) ? StateData : StateChecksum;
+                break;
+            }
+            case StateData:
+            {
+                frame[frameIndex++] = byte;
+                crc ^= byte;
+                if (frameIndex == 3U + messageLength)
+                {
+                    state = StateChecksum;
+                }
+                break;
+            }
+            case StateChecksum:
+            {
+                frame[frameIndex++] = byte;
+                crc ^= byte;
+                state = StateSync;
+                if (crc != 0)
+                {
+                    statistics.checksumErrors++;
+                    discardFrame();
+                    return DecodeBadChecksum;
+                }
+                statistics.frames++;
+                return DecodeComplete;
+            }
+        }
+    }
 
-    uint8_t msgLength = receivedData[index++];
-    buffer.push_back(msgLength);
+    return DecodeIncomplete;
+}
 
-    messageId = (ANT_Message)receivedData[index++];
-    buffer.push_back(messageId);
+void ANTMessageDecoder::discardFrame()
+{
+    // Everything after the sync byte may hold the start of the next frame:
+    // queue it for rescanning in front of the replay bytes not yet consumed
+    unsigned frameTail = frameIndex - 1;
+    unsigned replayTail = replayLen - replayPos;
+    memmove(replay + frameTail, replay + replayPos, replayTail);
+    memcpy(replay, frame + 1, frameTail);
+    replayPos = 0;
+    replayLen = frameTail + replayTail;
+}
 
-    messageData.assign(receivedData.begin() + index, receivedData.begin() + index + msgLength);
-    buffer.insert(buffer.end(), receivedData.begin() + index, receivedData.begin() + index + msgLength);
-    index += msgLength;
+ANT_Message ANTMessageDecoder::getMessageId() const
+{
+    return (ANT_Message)frame[2];
+}
 
-    uint8_t crc = receivedData[index++];
-    buffer.push_back(crc);
+const uint8_t *ANTMessageDecoder::getMessageData() const
+{
+    return frame + 3;
+}
 
-    if (calculateCRC(buffer) != 0)
-    {
-        parseThreadLogStream << "Bad CRC in ANT packet";
-        parseThreadLogFlush();
-        return false;
-    }
-    
-    receivedData.erase(receivedData.begin(), receivedData.begin() + index);
+uint8_t ANTMessageDecoder::getMessageLength() const
+{
+    return messageLength;
+}
 
-    return true;
+ANTDecoderStatistics ANTMessageDecoder::getStatistics() const
+{
+    return statistics;
 }
 
 uint8_t ANTMessage::calculateCRC(vector<uint8_t> &buffer)
@@ -113,10 +270,18 @@ uint8_t ANTMessage::calculateCRC(vector<uint8_t> &buffer)
     return crc;
 }
 
-volatile bool ANT::leaveFlag = false;
-
 ANT::ANT() :
-    channelStatus(ChannelStatusUnassigned)
+    reactor(NULL),
+    leaveFlag(false),
+    channelStatus(ChannelStatusUnassigned),
+    lastBurst(false),
+    burstFailed(false),
+    burstSequence(0),
+    burstGap(false),
+    receivedData(receiveBufferSize),
+    receivedDataEvent(-1),
+    burstSink(NULL),
+    shortMessages(0)
 {
     responseIdMap[MSG_ChannelEvent] = "Channel Event";
     responseIdMap[MSG_AssignChannel] = "Assign Channel";
@@ -128,6 +293,9 @@ ANT::ANT() :
     responseIdMap[MSG_SetChannelId] = "Set Channel Id";
     responseIdMap[MSG_OpenChannel] = "Open Channel";
     responseIdMap[MSG_SendBurstTransferPacket] = "Send Burst Transfer Packet";
+    responseIdMap[MSG_ChannelStatus] = "Channel Status";
+    responseIdMap[MSG_Capabilities] = "Capabilities";
+    responseIdMap[MSG_StartUpMessage] = "Start-up Message";
 
     responseCodeMap[EventResponseNoError] = "Ok";
     responseCodeMap[EventRXSearchTimeout] = "RX Search Timeout";
@@ -135,6 +303,7 @@ ANT::ANT() :
     responseCodeMap[EventTransferRXFailed] = "Transfer RX Failed";
     responseCodeMap[EventTransferTXCompleted] = "Transfer TX Completed";
     responseCodeMap[EventTransferTXFailed] = "Transfer TX Failed";
+    responseCodeMap[EventTransferTXStart] = "Transfer TX Start";
     responseCodeMap[EventTransferSequenceNumberError] = "Transfer Sequence Number Error";
 
     channelStatusMap[ChannelStatusUnassigned] = "Un-Assigned";
@@ -167,14 +336,22 @@ ANT::~ANT()
 {
 }
 
-bool ANT::init(string deviceName, speed_t speed)
+bool ANT::init(string deviceName, speed_t speed, SerialReactor *sharedReactor)
 {
     if (!sio.open(deviceName, speed))
     {
         return false;
     }
 
-    int rv = pthread_mutex_init(&receivedDataMutex, NULL);
+    receivedDataEvent = eventfd(0, 0);
+    if (receivedDataEvent == -1)
+    {
+        logStream << "Error creating event descriptor (" << dec << errno << "): " << strerror(errno);
+        logFlush();
+        return false;
+    }
+
+    int rv = pthread_mutex_init(&stateMutex, NULL);
     if (rv)
     {
         logStream << "Error initializing mutex (" << dec << errno << "): " << strerror(errno);
@@ -182,6 +359,14 @@ bool ANT::init(string deviceName, speed_t speed)
         return false;
     }
 
+    rv = pthread_cond_init(&stateCond, NULL);
+    if (rv)
+    {
+        logStream << "Error initializing condition variable (" << dec << errno << "): " << strerror(errno);
+        logFlush();
+        return false;
+    }
+
     rv = pthread_create(&parseThreadHandle, NULL, (void *(*)(void*))&ANT::parseThread, this);
     if (rv)
     {
@@ -190,6 +375,20 @@ bool ANT::init(string deviceName, speed_t speed)
         return false;
     }
 
+    // With a shared reactor the caller's thread services this stick along
+    // with the others, otherwise the stick gets a receive thread of its own
+    if (sharedReactor)
+    {
+        reactor = sharedReactor;
+        return reactor->add(sio, this);
+    }
+
+    reactor = &ownReactor;
+    if (!reactor->open() || !reactor->add(sio, this))
+    {
+        return false;
+    }
+
     rv = pthread_create(&receiveThreadHandle, NULL, (void *(*)(void*))&ANT::receiveThread, this);
     if (rv)
     {
@@ -204,6 +403,13 @@ bool ANT::init(string deviceName, speed_t speed)
 void ANT::leave()
 {
     leaveFlag = true;
+
+    uint64_t wakeup = 1;
+    ::write(receivedDataEvent, &wakeup, sizeof(wakeup));
+
+    pthread_mutex_lock(&stateMutex);
+    pthread_cond_broadcast(&stateCond);
+    pthread_mutex_unlock(&stateMutex);
     
     int rv = pthread_join(parseThreadHandle, NULL);
     if (rv)
@@ -212,41 +418,79 @@ void ANT::leave()
         logFlush();
     }
 
-    rv = pthread_join(receiveThreadHandle, NULL);
-    if (rv)
+    if (reactor == &ownReactor)
     {
-        logStream << "Error joining receving thread (" << dec << errno << "): " << strerror(errno);
-        logFlush();
+        rv = pthread_join(receiveThreadHandle, NULL);
+        if (rv)
+        {
+            logStream << "Error joining receving thread (" << dec << errno << "): " << strerror(errno);
+            logFlush();
+        }
+        ownReactor.close();
+    }
+    else
+    {
+        reactor->remove(sio);
     }
 
-    pthread_mutex_destroy(&receivedDataMutex);
+    ANTDecoderStatistics stats = getDecoderStatistics();
+    logStream << "ANT frames decoded: " << dec << stats.frames << ", bad checksums: " << stats.checksumErrors <<
+        ", bad lengths: " << stats.lengthErrors << ", short messages: " << stats.shortMessages <<
+        ", discarded bytes: " << stats.discardedBytes;
+    logFlush();
+
+    pthread_cond_destroy(&stateCond);
+    pthread_mutex_destroy(&stateMutex);
+    ::close(receivedDataEvent);
 
     sio.close();
 }
 
 bool ANT::receiveBuffer()
 {
-    vector<uint8_t> buffer;
-    if (!sio.receiveBuffer(buffer))
+    if (!sio.receiveBuffer(receivedData))
     {
         return false;
     }
 
-    pthread_mutex_lock(&receivedDataMutex);
-    receivedData.insert(receivedData.end(), buffer.begin(), buffer.end());
-    pthread_mutex_unlock(&receivedDataMutex);
+    uint64_t wakeup = 1;
+    ::write(receivedDataEvent, &wakeup, sizeof(wakeup));
 
     return true;
 }
 
+bool ANT::serialDataReceived(SerialIO &)
+{
+    if (!receiveBuffer())
+    {
+        logStream << "Error receiving buffer !!!";
+        logFlush();
+        return false;
+    }
+
+    return true;
+}
+
+bool ANT::serialTimeout(SerialIO &)
+{
+    logStream << "Timeout waiting data from port";
+    logFlush();
+
+    // A silent stick ends the session
+    return false;
+}
+
+void ANT::serialClosed(SerialIO &)
+{
+    leaveFlag = true;
+}
+
 void* ANT::receiveThread(ANT* ant)
 {
-    while(!leaveFlag)
+    while(!ant->leaveFlag)
     {
-        if (!ant->receiveBuffer())
+        if (!ant->reactor->run(waitTick))
         {
-            logStream << "Error receiving buffer !!!";
-            logFlush();
             break;
         }
     }
@@ -254,375 +498,720 @@ void* ANT::receiveThread(ANT* ant)
     logStream << "Exitting receive thread";
     logFlush();
     
-    leaveFlag = true;    
+    ant->leaveFlag = true;    
     
     pthread_exit((void *)0);
 }
 
 bool ANT::parseMessage()
 {
-    pthread_mutex_lock(&receivedDataMutex);
-    if (receivedData.size() > 0)
+    const uint8_t *ptr;
+    size_t len = receivedData.readable(ptr);
+    if (len == 0)
     {
-        vector<uint8_t> msgData;
-        if (!ANTMessage::getMessage(receivedData, messageId, msgData))
+        // The event is cleared before the ring is read again, so bytes
+        // committed after this point always leave it signalled
+        struct pollfd pfd;
+        pfd.fd = receivedDataEvent;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (::poll(&pfd, 1, waitTick) > 0)
         {
-            return false;
+            uint64_t count;
+            ::read(receivedDataEvent, &count, sizeof(count));
         }
-        pthread_mutex_unlock(&receivedDataMutex);
+        return true;
+    }
 
-        uint8_t messageChannel = msgData[0] & 0x1F;
-        //parseThreadLogStream << ">Channel: " << (unsigned)messageChannel << ", ";
+    size_t available = len;
+
+    pthread_mutex_lock(&stateMutex);
+    for (;;)
+    {
+        size_t consumed = 0;
+        ANTMessageDecoder::Result result = decoder.decode(ptr, len, consumed);
+        ptr += consumed;
+        len -= consumed;
 
-        switch(messageId)
+        if (result == ANTMessageDecoder::DecodeIncomplete)
         {
-            case MSG_ResponseEvent:
-            {
-                responseId = msgData[1];
-                responseCode = msgData[2];
-                parseThreadLogStream << "Response: " << responseIdMap[(unsigned)responseId] << "(" << (unsigned)responseId << ") " <<
-                    responseCodeMap[(unsigned)responseCode] << "(" << (unsigned)responseCode << ")";
-                break;
-            }
+            break;
+        }
 
-            case MSG_ChannelStatus:
-            {
-                channelStatus = msgData[1];
-                parseThreadLogStream << "Channel Status: " << channelStatusMap[(unsigned)channelStatus] << "(" << (unsigned)channelStatus << ")";
-                break;
-            }
+        if (result == ANTMessageDecoder::DecodeBadChecksum)
+        {
+            parseThreadLogStream << "Bad CRC in ANT packet, resynchronizing";
+            parseThreadLogFlush();
+            continue;
+        }
 
-            case MSG_SetChannelId:
+        if (result == ANTMessageDecoder::DecodeBadLength)
+        {
+            parseThreadLogStream << "ANT packet length above " << dec << Max_Message_Length << " bytes, resynchronizing";
+            parseThreadLogFlush();
+            continue;
+        }
+
+        handleMessage(decoder.getMessageId(), decoder.getMessageData(), decoder.getMessageLength());
+    }
+
+    pthread_cond_broadcast(&stateCond);
+    pthread_mutex_unlock(&stateMutex);
+
+    receivedData.consume(available);
+    sio.resumeReceive();
+
+    return true;
+}
+
+// Fewest payload bytes handleMessage() reads for a message id
+static uint8_t minimumMessageLength(ANT_Message id)
+{
+    switch (id)
+    {
+        case MSG_ResponseEvent:
+            return 3;
+        case MSG_ChannelStatus:
+            return 2;
+        case MSG_SetChannelId:
+            return 5;
+        case MSG_SendBroadcastData:
+        case MSG_SendBurstTransferPacket:
+            return 9;
+        default:
+            return 1;
+    }
+}
+
+void ANT::handleMessage(ANT_Message id, const uint8_t *msgData, uint8_t msgLength)
+{
+    if (msgLength < minimumMessageLength(id))
+    {
+        shortMessages++;
+        parseThreadLogStream << "Dropping message 0x" << hex << (unsigned)id << " of " << dec << (unsigned)msgLength << " bytes";
+        parseThreadLogFlush();
+        return;
+    }
+
+    uint8_t messageChannel = msgData[0] & 0x1F;
+    //parseThreadLogStream << ">Channel: " << (unsigned)messageChannel << ", ";
+
+    switch(id)
+    {
+        case MSG_ResponseEvent:
+        {
+            uint8_t responseId = msgData[1];
+            uint8_t responseCode = msgData[2];
+            if (responseId != MSG_ChannelEvent)
             {
-                uint16_t deviceId = (msgData[2] << 8) | msgData[1];
-                uint8_t deviceType = msgData[3];
-                uint8_t transmissionType = msgData[4];
-                parseThreadLogStream << "Channel Id: DeviceId=" << deviceId << ", DeviceType=" << (unsigned)deviceType << ", TransmissionType=" << (unsigned)transmissionType;
-                break;
+                completeRequest(messageChannel, responseId, responseCode);
             }
-
-            case MSG_Capabilities:
+            else
             {
-                parseThreadLogStream << "Capabilities";
-                break;
+                // A burst being received ends early on a failed reception
+                if (responseCode == EventRXFail || responseCode == EventTransferRXFailed)
+                {
+                    burstFailed = true;
+                }
+                completeEvent(messageChannel, responseCode);
             }
+            notifyObservers(NotifyResponse, messageChannel, responseId, responseCode);
+            parseThreadLogStream << "Response: " << responseIdMap[(unsigned)responseId] << "(" << (unsigned)responseId << ") " <<
+                responseCodeMap[(unsigned)responseCode] << "(" << (unsigned)responseCode << ")";
+            break;
+        }
 
-            case MSG_SendBroadcastData:
-            {
-                broadcast = true;
+        case MSG_ChannelStatus:
+        {
+            channelStatus = msgData[1];
+            completeRequest(messageChannel, id, EventResponseNoError);
+            notifyObservers(NotifyChannelStatus, messageChannel, id, channelStatus & 0x03);
+            parseThreadLogStream << "Channel Status: " << channelStatusMap[(unsigned)channelStatus] << "(" << (unsigned)channelStatus << ")";
+            break;
+        }
 
-                uint8_t page = msgData[1];
-                bool pageToggle = page & 0x80;
-                page &= 0x7F;
-                
-                //parseThreadLogStream << "Broadcast data (Page=" << hex << (unsigned)page << "): " << GarminConvert::gHex(msgData) << " : ";
+        case MSG_SetChannelId:
+        {
+            uint16_t deviceId = (msgData[2] << 8) | msgData[1];
+            uint8_t deviceType = msgData[3];
+            uint8_t transmissionType = msgData[4];
+            completeRequest(messageChannel, id, EventResponseNoError);
+            parseThreadLogStream << "Channel Id: DeviceId=" << deviceId << ", DeviceType=" << (unsigned)deviceType << ", TransmissionType=" << (unsigned)transmissionType;
+            break;
+        }
 
-                switch(page)
+        case MSG_Capabilities:
+        {
+            parseThreadLogStream << "Capabilities";
+            completeRequest(messageChannel, id, EventResponseNoError);
+            break;
+        }
+
+        case MSG_StartUpMessage:
+        {
+            // Carries the reset reason instead of a channel number
+            parseThreadLogStream << "Start-up: reason 0x" << hex << (unsigned)msgData[0] << dec;
+            completeRequest(0, id, EventResponseNoError);
+            break;
+        }
+
+        case MSG_SendBroadcastData:
+        {
+            uint8_t page = msgData[1];
+            bool pageToggle = page & 0x80;
+            page &= 0x7F;
+            
+            //parseThreadLogStream << "Broadcast data (Page=" << hex << (unsigned)page << "): " << GarminConvert::gHex(msgData) << " : ";
+
+            switch(page)
+            {
+                case ANTFSBeacon:
                 {
-                    case ANTFSBeacon:
-                    {
-                        ANTFSBeaconFormat beacon = { 0 };
-                        memcpy(&beacon, &msgData.front()+1, sizeof(beacon));
-
-                        uint8_t channelPeriod = beacon.status1.beaconChannelPeriod;
-                        /*parseThreadLogStream << "BeaconChannelPeriod=" << channelPeriodMap[channelPeriod] << ", ";
-                        parseThreadLogStream << "Pairing=" << (beacon.status1.pairingEnabled?"Enabled":"Disabled") << ", ";
-                        parseThreadLogStream << "Upload=" << (beacon.status1.uploadEnabled?"Enabled":"Disabled") << ", ";
-                        parseThreadLogStream << "Data=" << (beacon.status1.dataAvailable?"Available":"Not available") << ", ";
+                    ANTFSBeaconFormat beacon = { 0 };
+                    memcpy(&beacon, msgData+1, sizeof(beacon));
+
+                    uint8_t channelPeriod = beacon.status1.beaconChannelPeriod;
+                    /*parseThreadLogStream << "BeaconChannelPeriod=" << channelPeriodMap[channelPeriod] << ", ";
+                    parseThreadLogStream << "Pairing=" << (beacon.status1.pairingEnabled?"Enabled":"Disabled") << ", ";
+                    parseThreadLogStream << "Upload=" << (beacon.status1.uploadEnabled?"Enabled":"Disabled") << ", ";
+                    parseThreadLogStream << "Data=" << (beacon.status1.dataAvailable?"Available":"Not available") << ", ";
 			*/
-                        clientDeviceState = beacon.status2.clientDeviceState;
-                        //parseThreadLogStream << "ClientDeviceState=" << clientDeviceStateMap[(unsigned)clientDeviceState] << ", ";
+                    clientDeviceState = beacon.status2.clientDeviceState;
+                    notifyObservers(NotifyBeacon, messageChannel, id, clientDeviceState);
+                    //parseThreadLogStream << "ClientDeviceState=" << clientDeviceStateMap[(unsigned)clientDeviceState] << ", ";
 
-                        uint8_t authType = beacon.authType;
-                        //parseThreadLogStream << "AuthType=" << authTypesMap[authType] << ", ";
+                    uint8_t authType = beacon.authType;
+                    //parseThreadLogStream << "AuthType=" << authTypesMap[authType] << ", ";
 
-                        if (clientDeviceState == DeviceStateLink)
-                        {
+                    if (clientDeviceState == DeviceStateLink)
+                    {
 			  //parseThreadLogStream << "ManufacturerID=" << beacon.devDescr.manufacturerID << ", DeviceType=" << hex << beacon.devDescr.deviceType;
-                        }
-                        else
-                        {
+                    }
+                    else
+                    {
 			  //parseThreadLogStream << "SN=" << hex << beacon.hostSN;
-                        }
-                        
-                        break;
                     }
+                    
+                    break;
+                }
 
-                    case 1:
-                    {
+                case 1:
+                {
 #pragma pack(1)
-                        struct Page1
-                        {
-                            uint8_t operTime[3];
-                            uint16_t curEventTime; // 1/1024 seconds
-                            uint8_t eventCount;
-                            uint8_t hr;
-                        } msg;
+                    struct Page1
+                    {
+                        uint8_t operTime[3];
+                        uint16_t curEventTime; // 1/1024 seconds
+                        uint8_t eventCount;
+                        uint8_t hr;
+                    } msg;
 #pragma pack()
-                        memcpy(&msg, &msgData.front()+2, sizeof(msg));
+                    memcpy(&msg, msgData+2, sizeof(msg));
 
-                        unsigned opTime = ((msg.operTime[2] << 16) | (msg.operTime[1] << 8) | msg.operTime[0]) << 1;
-                        
-                        parseThreadLogStream << dec <<
-                            "HR=" << (unsigned)msg.hr << ", " <<
-                            "Count=" << (unsigned)msg.eventCount << ", " <<
-                            "OperationlTime=" << opTime/60 << ":" << opTime%60;
-                        
-                        break;
-                    }
+                    unsigned opTime = ((msg.operTime[2] << 16) | (msg.operTime[1] << 8) | msg.operTime[0]) << 1;
+                    
+                    parseThreadLogStream << dec <<
+                        "HR=" << (unsigned)msg.hr << ", " <<
+                        "Count=" << (unsigned)msg.eventCount << ", " <<
+                        "OperationlTime=" << opTime/60 << ":" << opTime%60;
+                    
+                    break;
+                }
 
-                    case 2:
-                    {
+                case 2:
+                {
 #pragma pack(1)
-                        struct Page2
-                        {
-                            uint8_t manufacturerID;
-                            uint16_t serialNumber;
-                            uint16_t curEventTime; // 1/1024 seconds
-                            uint8_t eventCount;
-                            uint8_t hr;
-                        } msg;
+                    struct Page2
+                    {
+                        uint8_t manufacturerID;
+                        uint16_t serialNumber;
+                        uint16_t curEventTime; // 1/1024 seconds
+                        uint8_t eventCount;
+                        uint8_t hr;
+                    } msg;
 #pragma pack()
-                        memcpy(&msg, &msgData.front()+2, sizeof(msg));
+                    memcpy(&msg, msgData+2, sizeof(msg));
 
-                        parseThreadLogStream << dec << 
-                            "HR=" << (unsigned)msg.hr << ", " <<
-                            "Count=" << (unsigned)msg.eventCount << ", " <<
-                            "Manufacturer=" << (unsigned)msg.manufacturerID << ", " <<
-                            "SerialNumber=" << msg.serialNumber;
-                        
-                        break;
-                    }
+                    parseThreadLogStream << dec << 
+                        "HR=" << (unsigned)msg.hr << ", " <<
+                        "Count=" << (unsigned)msg.eventCount << ", " <<
+                        "Manufacturer=" << (unsigned)msg.manufacturerID << ", " <<
+                        "SerialNumber=" << msg.serialNumber;
                     
-                    case 3:
-                    {
+                    break;
+                }
+                
+                case 3:
+                {
 #pragma pack(1)
-                        struct Page3
-                        {
-                            uint8_t hwVersion;
-                            uint8_t swVersion;
-                            uint8_t modelNumber;
-                            uint16_t curEventTime; // 1/1024 seconds
-                            uint8_t eventCount;
-                            uint8_t hr;
-                        } msg;
-#pragma pack()
-                        memcpy(&msg, &msgData.front()+2, sizeof(msg));
-
-                        parseThreadLogStream << dec << 
-                            "HR=" << (unsigned)msg.hr << ", " <<
-                            "Count=" << (unsigned)msg.eventCount << ", " <<
-                            "HWVersion=" << (unsigned)msg.hwVersion << ", " <<
-                            "SWVersion=" << (unsigned)msg.swVersion << ", " <<
-                            "ModelNumber=" << (unsigned)msg.modelNumber;
-                        
-                        break;
-                    }
-                   
-                    case 4:
+                    struct Page3
                     {
+                        uint8_t hwVersion;
+                        uint8_t swVersion;
+                        uint8_t modelNumber;
+                        uint16_t curEventTime; // 1/1024 seconds
+                        uint8_t eventCount;
+                        uint8_t hr;
+                    } msg;
+#pragma pack()
+                    memcpy(&msg, msgData+2, sizeof(msg));
+
+                    parseThreadLogStream << dec << 
+                        "HR=" << (unsigned)msg.hr << ", " <<
+                        "Count=" << (unsigned)msg.eventCount << ", " <<
+                        "HWVersion=" << (unsigned)msg.hwVersion << ", " <<
+                        "SWVersion=" << (unsigned)msg.swVersion << ", " <<
+                        "ModelNumber=" << (unsigned)msg.modelNumber;
+                    
+                    break;
+                }
+               
+                case 4:
+                {
 #pragma pack(1)
-                        struct Page4
-                        {
-                            uint8_t manufacturerSpecific;
-                            uint16_t prevEventTime; // 1/1024 seconds
-                            uint16_t curEventTime; // 1/1024 seconds
-                            uint8_t eventCount;
-                            uint8_t hr;
-                        } msg;
+                    struct Page4
+                    {
+                        uint8_t manufacturerSpecific;
+                        uint16_t prevEventTime; // 1/1024 seconds
+                        uint16_t curEventTime; // 1/1024 seconds
+                        uint8_t eventCount;
+                        uint8_t hr;
+                    } msg;
 #pragma pack()
-                        memcpy(&msg, &msgData.front()+2, sizeof(msg));
-
-                        unsigned prevTime = msg.prevEventTime;
-                        unsigned curTime = msg.curEventTime;
-                        if (curTime < prevTime)
-                        {
-                            curTime += 0x10000;
-                        }
-                            
-                        double rr = ((double)curTime - (double)prevTime)/1024.0;
-                        
-                        parseThreadLogStream << dec <<
-                            "HR=" << (unsigned)msg.hr << ", " <<
-                            "Count=" << (unsigned)msg.eventCount << ", " <<
-                            "RR=" << rr;
-                        
-                        break;
+                    memcpy(&msg, msgData+2, sizeof(msg));
+
+                    unsigned prevTime = msg.prevEventTime;
+                    unsigned curTime = msg.curEventTime;
+                    if (curTime < prevTime)
+                    {
+                        curTime += 0x10000;
                     }
+                        
+                    double rr = ((double)curTime - (double)prevTime)/1024.0;
+                    
+                    parseThreadLogStream << dec <<
+                        "HR=" << (unsigned)msg.hr << ", " <<
+                        "Count=" << (unsigned)msg.eventCount << ", " <<
+                        "RR=" << rr;
+                    
+                    break;
                 }
+            }
 
-                break;
+            break;
+        }
+
+        case MSG_SendBurstTransferPacket:
+        {
+            uint8_t seq = (msgData[0] >> 5) & 0x3;
+            // Sequence numbers run 0, 1, 2, 3, 1, 2, 3, ...; anything after a
+            // missing packet is dropped so receivers only see contiguous data
+            if (seq == 0)
+            {
+                burstData.clear();
+                burstGap = false;
             }
+            else if (seq != burstSequence)
+            {
+                burstGap = true;
+            }
+            burstSequence = (seq == 3) ? 1 : seq + 1;
+            lastBurst = msgData[0] >> 7;
 
-            case MSG_SendBurstTransferPacket:
+            if (burstGap)
+            {
+                break;
+            }
+            else if (burstSink)
             {
-                uint8_t seq = (msgData[0] >> 5) & 0x3;
-                lastBurst = msgData[0] >> 7;
+                burstSink->burstReceived(msgData+1, msgLength-1);
+            }
+            else
+            {
+                burstData.insert(burstData.end(), msgData+1, msgData+msgLength);
+            }
+
+            //SSP parseThreadLogStream << "Burst Data: Sequence=" << (unsigned)seq << " Last=" << string(lastBurst?"Yes":"No") << ":\t" << GarminConvert::gHex((uint8_t *)msgData+1, msgLength-1);
+            break;
+        }
+
+        default:
+        {
+            parseThreadLogStream << "Message Id: " << hex << id;
+        }
+    }
+    
+    //parseThreadLogFlush();
+
+    //parseThreadLogFlush();
+}
+
+void* ANT::parseThread(ANT* ant)
+{
+    while(!ant->leaveFlag)
+    {
+        if (!ant->parseMessage())
+        {
+            logStream << "Error parsing message !!!";
+            logFlush();
+            break;
+        }
+    }
+
+    logStream << "Exitting parse thread";
+    logFlush();
+    
+    ant->leaveFlag = true;
+    
+    pthread_exit((void *)0);
+}
+
+
+bool ANT::waitStateChange()
+{
+    if (leaveFlag)
+    {
+        return false;
+    }
+
+    struct timespec deadline;
+    waitDeadline(deadline, waitTick);
+    pthread_cond_timedwait(&stateCond, &stateMutex, &deadline);
+
+    return !leaveFlag;
+}
+
+void ANT::addRequest(ANTRequest &request, uint8_t channel, uint8_t id)
+{
+    request.channel = channel;
+    request.messageId = id;
+    request.events.clear();
+    request.completed = false;
+    request.responseCode = EventResponseNoError;
+
+    pthread_mutex_lock(&stateMutex);
+    pendingRequests.insert(make_pair(requestKey(channel, id), &request));
+    pthread_mutex_unlock(&stateMutex);
+}
+
+void ANT::addEventRequest(ANTRequest &request, uint8_t channel, const uint8_t events[], unsigned count)
+{
+    pthread_mutex_lock(&stateMutex);
+    insertEventRequest(request, channel, events, count);
+    pthread_mutex_unlock(&stateMutex);
+}
+
+void ANT::insertEventRequest(ANTRequest &request, uint8_t channel, const uint8_t events[], unsigned count)
+{
+    // Called with stateMutex held
+    request.channel = channel;
+    request.messageId = MSG_ChannelEvent;
+    request.events.assign(events, events + count);
+    request.completed = false;
+    request.responseCode = EventResponseNoError;
+
+    pendingRequests.insert(make_pair(requestKey(channel, MSG_ChannelEvent), &request));
+}
+
+void ANT::removeRequest(ANTRequest &request)
+{
+    pthread_mutex_lock(&stateMutex);
+    eraseRequest(request);
+    pthread_mutex_unlock(&stateMutex);
+}
+
+bool ANT::requestCompleted(ANTRequest &request, uint8_t &code)
+{
+    pthread_mutex_lock(&stateMutex);
+    bool completed = request.completed;
+    code = request.responseCode;
+    pthread_mutex_unlock(&stateMutex);
+
+    return completed;
+}
+
+void ANT::eraseRequest(ANTRequest &request)
+{
+    pair<RequestMap::iterator, RequestMap::iterator> range = pendingRequests.equal_range(requestKey(request.channel, request.messageId));
+    for (RequestMap::iterator it = range.first; it != range.second; ++it)
+    {
+        if (it->second == &request)
+        {
+            pendingRequests.erase(it);
+            break;
+        }
+    }
+}
+
+void ANT::completeRequest(uint8_t channel, uint8_t id, uint8_t code)
+{
+    // Called by the parse thread with stateMutex held; the oldest matching
+    // request gets the answer
+    uint16_t key = requestKey(channel, id);
+    RequestMap::iterator it = pendingRequests.lower_bound(key);
+    if (it == pendingRequests.end() || it->first != key)
+    {
+        return;
+    }
+
+    ANTRequest *request = it->second;
+    pendingRequests.erase(it);
+    request->responseCode = code;
+    request->completed = true;
+}
+
+void ANT::completeEvent(uint8_t channel, uint8_t code)
+{
+    // Called by the parse thread with stateMutex held; channel events are
+    // delivered to every request waiting for them
+    pair<RequestMap::iterator, RequestMap::iterator> range = pendingRequests.equal_range(requestKey(channel, MSG_ChannelEvent));
+    RequestMap::iterator it = range.first;
+    while (it != range.second)
+    {
+        ANTRequest *request = it->second;
+        if (!request->events.empty() && find(request->events.begin(), request->events.end(), code) == request->events.end())
+        {
+            ++it;
+            continue;
+        }
+
+        pendingRequests.erase(it++);
+        request->responseCode = code;
+        request->completed = true;
+    }
+}
+
+void ANT::notifyObservers(ANTNotification kind, uint8_t channel, uint8_t id, uint8_t value)
+{
+    // Called by the parse thread with stateMutex held
+    for (size_t i=0; i<observers.size(); i++)
+    {
+        observers[i]->notify(kind, channel, id, value);
+    }
+}
+
+void ANT::subscribe(ANTObserver &observer)
+{
+    pthread_mutex_lock(&stateMutex);
+    observers.push_back(&observer);
+    pthread_mutex_unlock(&stateMutex);
+}
 
-                msgData.erase(msgData.begin());
-                burstData.insert(burstData.end(), msgData.begin(), msgData.end());
+void ANT::unsubscribe(ANTObserver &observer)
+{
+    pthread_mutex_lock(&stateMutex);
+    observers.erase(remove(observers.begin(), observers.end(), &observer), observers.end());
+    pthread_mutex_unlock(&stateMutex);
+}
 
-                //SSP parseThreadLogStream << "Burst Data: Sequence=" << (unsigned)seq << " Last=" << string(lastBurst?"Yes":"No") << ":\t" << GarminConvert::hexDump(msgData);
-                break;
-            }
+bool ANT::wait(ANTFuture &future, unsigned timeout)
+{
+    // The future is unsubscribed once it completed or timed out
+    struct timespec deadline;
+    waitDeadline(deadline, timeout);
 
-            default:
-            {
-                parseThreadLogStream << "Message Id: " << hex << messageId;
-            }
+    pthread_mutex_lock(&stateMutex);
+    while (!future.completed && !leaveFlag)
+    {
+        if (pthread_cond_timedwait(&stateCond, &stateMutex, &deadline) == ETIMEDOUT)
+        {
+            break;
         }
-        
-        //parseThreadLogFlush();
     }
-    else
+    observers.erase(remove(observers.begin(), observers.end(), &future), observers.end());
+    bool completed = future.completed;
+    pthread_mutex_unlock(&stateMutex);
+
+    return completed;
+}
+
+uint16_t ANT::requestKey(uint8_t channel, uint8_t id)
+{
+    return (channel << 8) | id;
+}
+
+bool ANT::sendRequest(ANTRequest &request, ANT_Message id, vector<uint8_t> &data)
+{
+    // Registered before sending, so a fast answer cannot be missed
+    addRequest(request, data[0], id);
+    if (!ANTMessage::sendMessage(sio, id, data))
     {
-        pthread_mutex_unlock(&receivedDataMutex);
-        usleep(sleepTime);
+        removeRequest(request);
+        return false;
     }
-    
+
     return true;
 }
 
-void* ANT::parseThread(ANT* ant)
+bool ANT::waitEvent(ANTRequest &request, unsigned timeout)
 {
-    while(!leaveFlag)
+    struct timespec deadline;
+    waitDeadline(deadline, timeout);
+
+    pthread_mutex_lock(&stateMutex);
+    while (!request.completed && !leaveFlag)
     {
-        if (!ant->parseMessage())
+        if (pthread_cond_timedwait(&stateCond, &stateMutex, &deadline) == ETIMEDOUT)
         {
-            logStream << "Error parsing message !!!";
-            logFlush();
             break;
         }
     }
 
-    logStream << "Exitting parse thread";
-    logFlush();
-    
-    leaveFlag = true;
-    
-    pthread_exit((void *)0);
-}
+    bool completed = request.completed;
+    if (!completed)
+    {
+        eraseRequest(request);
+    }
+    pthread_mutex_unlock(&stateMutex);
 
+    return completed;
+}
 
-bool ANT::waitMessage(uint8_t id)
+bool ANT::waitRequest(ANTRequest &request, unsigned timeout)
 {
-//    messageId = MSG_Null;
+    waitEvent(request, timeout);
 
-    while(messageId != id)
+    pthread_mutex_lock(&stateMutex);
+    bool rv = request.completed && request.responseCode == EventResponseNoError;
+    if (!request.completed)
     {
-        if (responseId == MSG_ChannelEvent)
-        {
-            switch (responseId)
-            {
-                case EventRXFail:
-                {
-                    logStream << "! EventRXFail" << endl;
-                    logFlush();
-
-                    return false;
-                }
-                case EventTransferTXFailed:
-                {
-                    logStream << "! EventTransferTXFailed" << endl;
-                    logFlush();
-
-                    return false;
-                }
+        logStream << "! Timeout waiting for response to " << responseIdMap[request.messageId] << "(0x" << hex << (unsigned)request.messageId << ")" << dec;
+    }
+    else if (!rv)
+    {
+        logStream << "! " << responseIdMap[request.messageId] << "(0x" << hex << (unsigned)request.messageId << ") failed: " <<
+            responseCodeMap[request.responseCode] << "(0x" << (unsigned)request.responseCode << ")" << dec;
+    }
+    pthread_mutex_unlock(&stateMutex);
 
-                default:
-                {
-                    usleep(sleepTime);
-                }
-            }
-        }
+    if (!rv)
+    {
+        logFlush();
     }
 
-    return true;
+    return rv;
 }
 
-bool ANT::waitResponse(uint8_t id)
+bool ANT::waitMessage(ANTRequest &answer, ANTRequest &refusal, unsigned timeout)
 {
-//    responseId = MSG_Null;
-    do
-    {
-        usleep(sleepTime);
+    // The stick answers a request it cannot serve with an error response to
+    // MSG_RequestMessage instead of the message, so either ends the wait
+    struct timespec deadline;
+    waitDeadline(deadline, timeout);
 
-        if (responseId == MSG_ChannelEvent)
+    pthread_mutex_lock(&stateMutex);
+    while (!answer.completed && !(refusal.completed && refusal.responseCode != EventResponseNoError) && !leaveFlag)
+    {
+        if (pthread_cond_timedwait(&stateCond, &stateMutex, &deadline) == ETIMEDOUT)
         {
-            switch (responseCode)
-            {
-                case EventRXFail:
-                {
-                    logStream << "! RX failed" << endl;
-                    logFlush();
+            break;
+        }
+    }
 
-                    return false;
-                }
-                case EventTransferTXFailed:
-                {
-                    logStream << "! TX failed" << endl;
-                    logFlush();
+    bool rv = answer.completed;
+    if (!answer.completed)
+    {
+        eraseRequest(answer);
+    }
+    if (!refusal.completed)
+    {
+        eraseRequest(refusal);
+    }
 
-                    return false;
-                }
-            }
-        }
+    if (!rv && refusal.completed)
+    {
+        logStream << "! Request for " << responseIdMap[answer.messageId] << "(0x" << hex << (unsigned)answer.messageId << ") refused: " <<
+            responseCodeMap[refusal.responseCode] << "(0x" << (unsigned)refusal.responseCode << ")" << dec;
+    }
+    else if (!rv)
+    {
+        logStream << "! Timeout waiting for " << responseIdMap[answer.messageId] << "(0x" << hex << (unsigned)answer.messageId << ")" << dec;
     }
-    while(responseId != id);
+    pthread_mutex_unlock(&stateMutex);
 
-    return true;
+    if (!rv)
+    {
+        logFlush();
+    }
+
+    return rv;
 }
 
 bool ANT::waitBroadcast()
 {
-    broadcast = false;
-    do
-    {
-        usleep(sleepTime);
+    // Next beacon of a client that is ready for a command, or a failed
+    // reception on the way
+    static const uint8_t readyStates[] = { DeviceStateLink, DeviceStateAuthentication, DeviceStateTransport };
+    static const uint8_t failures[] = { EventRXFail };
+    ANTFuture beacon;
+    beacon.accept(NotifyBeacon, readyStates, sizeof(readyStates));
+    beacon.accept(NotifyResponse, failures, sizeof(failures));
+    subscribe(beacon);
+
+    return wait(beacon, beaconTimeout) && beacon.kind == NotifyBeacon;
+}
 
-        if (clientDeviceState == DeviceStateBusy)
+bool ANT::waitLastBurst()
+{
+    // Called with stateMutex held. The burst may have started before the
+    // caller got here; whatever arrived so far is kept until it is consumed.
+    while(!lastBurst)
+    {
+        if (burstFailed)
         {
-            continue;
+            return false;
         }
 
-        if (responseId == MSG_ChannelEvent)
+        if (!waitStateChange())
         {
-            switch (responseCode)
-            {
-                case EventRXFail:
-                    return false;
-            }
+            return false;
         }
     }
-    while(!broadcast);
 
-    return true;
+    return !burstGap;
 }
 
-bool ANT::waitBurst(vector<uint8_t> &data)
+void ANT::consumeBurst()
 {
+    // Called with stateMutex held
     burstData.clear();
     lastBurst = false;
+    burstFailed = false;
+    burstSequence = 0;
+    burstGap = false;
+}
 
-    do
+bool ANT::waitBurst(vector<uint8_t> &data)
+{
+    pthread_mutex_lock(&stateMutex);
+    bool rv = waitLastBurst();
+    if (rv)
     {
-        usleep(sleepTime);
+        data.swap(burstData);
+    }
+    consumeBurst();
+    pthread_mutex_unlock(&stateMutex);
 
-        if (responseId == MSG_ChannelEvent)
-        {
-            switch (responseCode)
-            {
-                case EventRXFail:
-                case EventTransferRXFailed:
-                    return false;
-            }
-        }
+    return rv;
+}
+
+bool ANT::waitBurst(ANTBurstSink &sink)
+{
+    pthread_mutex_lock(&stateMutex);
+    if (!burstData.empty())
+    {
+        sink.burstReceived(&burstData.front(), burstData.size());
+        burstData.clear();
     }
-    while(!lastBurst);
+    burstSink = &sink;
 
-    data = burstData;
+    bool rv = waitLastBurst();
 
-    return true;
+    burstSink = NULL;
+    consumeBurst();
+    pthread_mutex_unlock(&stateMutex);
+
+    return rv;
 }
 
 bool ANT::waitBurst(uint8_t data[], unsigned len)
@@ -651,216 +1240,160 @@ bool ANT::getChannelStatus(uint8_t &status)
     return true;
 }
 
-string ANT::getChannelStatusString()
-{
-    return channelStatusMap[(unsigned)channelStatus];
-}
-
-bool ANT::resetSystem()
+bool ANT::waitChannelStatus(uint8_t channel, uint8_t status, unsigned timeout)
 {
-    logStream << "<RESET system";
-    logFlush();
+    // The stick only reports the state when asked. Ask again whenever an
+    // event arrives on the channel, or after a short while without one.
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    vector<uint8_t> data;
-    data.push_back(0);
-    if (!ANTMessage::sendMessage(sio, MSG_ResetSystem, data))
+    for (;;)
     {
-        return false;
-    }
-    usleep(500000);
-
-    return true;
-}
-
-bool ANT::setNetworkKey(uint8_t network, vector<uint8_t> &key)
-{
-    logStream << "<Set network key (network=" << (unsigned)network << ", key=" << GarminConvert::gHex(key) << ")";
-    logFlush();
+        ANTRequest answer;
+        ANTRequest refusal;
+        addRequest(answer, channel, MSG_ChannelStatus);
+        addRequest(refusal, channel, MSG_RequestMessage);
 
-    vector<uint8_t> data;
-    data.push_back(network);
-    data.insert(data.end(), key.begin(), key.end());
-    if (!ANTMessage::sendMessage(sio, MSG_SetNetworkKey, data))
-    {
-        logStream << "!Error sending SetNetworkKey command";
-        logFlush();
+        vector<uint8_t> data;
+        data.push_back(channel);
+        data.push_back(MSG_ChannelStatus);
+        if (!ANTMessage::sendMessage(sio, MSG_RequestMessage, data))
+        {
+            removeRequest(answer);
+            removeRequest(refusal);
+            return false;
+        }
 
-        return false;
-    }
-    if (!waitResponse(MSG_SetNetworkKey))
-    {
-        logStream << "!Error waiting response to SetNetworkKey command";
-        logFlush();
+        if (!waitMessage(answer, refusal))
+        {
+            return false;
+        }
 
-        return false;
-    }
+        // The upper bits hold the channel type and network number
+        uint8_t current = channelStatus & 0x03;
+        if (current == status)
+        {
+            return true;
+        }
 
-    return true;
-}
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        unsigned elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (elapsed >= timeout)
+        {
+            logStream << "! Timeout waiting for channel " << dec << (unsigned)channel << " to become " << channelStatusMap[status] <<
+                ", still " << channelStatusMap[current];
+            logFlush();
 
-bool ANT::assignChannel(uint8_t channel, ChannelType type, uint8_t network)
-{
-    logStream << "<Assign channel (channel=" << dec << (unsigned)channel << ", type=" << (unsigned)type << ", network=" << (unsigned)network << ")";
-    logFlush();
+            return false;
+        }
 
-    vector<uint8_t> data;
-    data.push_back(channel);
-    data.push_back(type);
-    data.push_back(network);
-    if (!ANTMessage::sendMessage(sio, MSG_AssignChannel, data))
-    {
-        return false;
-    }
-    if (!waitResponse(MSG_AssignChannel))
-    {
-        return false;
+        ANTRequest event;
+        addEventRequest(event, channel, NULL, 0);
+        waitEvent(event, min(channelStatusPoll, timeout - elapsed));
     }
-
-    return true;
 }
 
-bool ANT::setChannelPeriod(uint8_t channel, uint16_t period)
+string ANT::getChannelStatusString()
 {
-    logStream << "<Set channel period (channel=" << (unsigned)channel << ", period=" << period << ")";
-    logFlush();
-
-    vector<uint8_t> data;
-    data.push_back(channel);
-    uint8_t *bPeriod = (uint8_t *)&period;
-    data.push_back(bPeriod[0]);
-    data.push_back(bPeriod[1]);
-    if (!ANTMessage::sendMessage(sio, MSG_SetChannelPeriod, data))
-    {
-        return false;
-    }
-    if (!waitResponse(MSG_SetChannelPeriod))
-    {
-        return false;
-    }
-
-    return true;
+    return channelStatusMap[(unsigned)channelStatus];
 }
 
-bool ANT::setChannelSearchTimeout(uint8_t channel, uint8_t timeout)
+ANTDecoderStatistics ANT::getDecoderStatistics()
 {
-    logStream << "<Set channel search timeout (channel=" << (unsigned)channel << ", timeout=" << (unsigned)timeout << ")";
-    logFlush();
-
-    vector<uint8_t> data;
-    data.push_back(channel);
-    data.push_back(timeout);
-    if (!ANTMessage::sendMessage(sio, MSG_SetChannelSearchTimeout, data))
-    {
-        return false;
-    }
-    if (!waitResponse(MSG_SetChannelSearchTimeout))
-    {
-        return false;
-    }
-
-    return true;
+    // The parse thread updates the counters with stateMutex held
+    pthread_mutex_lock(&stateMutex);
+    ANTDecoderStatistics stats = decoder.getStatistics();
+    stats.shortMessages = shortMessages;
+    pthread_mutex_unlock(&stateMutex);
+    return stats;
 }
 
-bool ANT::setChannelRFFreq(uint8_t channel, uint8_t frequency)
+bool ANT::resetSystem()
 {
-    logStream << "<Set channel radio frequency (channel=" << (unsigned)channel << ", frequency=24" << (unsigned)frequency << "Mhz)";
+    logStream << "<RESET system";
     logFlush();
 
+    // The stick announces itself with a start-up message once the reset is
+    // done. Sticks that do not send one are given the full timeout.
+    ANTRequest request;
+    addRequest(request, 0, MSG_StartUpMessage);
+
     vector<uint8_t> data;
-    data.push_back(channel);
-    data.push_back(frequency);
-    if (!ANTMessage::sendMessage(sio, MSG_SetChannelRadioFreq, data))
+    data.push_back(0);
+    if (!ANTMessage::sendMessage(sio, MSG_ResetSystem, data))
     {
+        removeRequest(request);
         return false;
     }
-    if (!waitResponse(MSG_SetChannelRadioFreq))
+
+    if (!waitEvent(request, startUpTimeout))
     {
-        return false;
+        logStream << "No start-up message after reset";
+        logFlush();
     }
 
     return true;
 }
 
-bool ANT::setSearchWaveform(uint8_t channel, uint16_t waveform)
+bool ANT::openChannel(uint8_t channel, const ANTChannelProfile &profile)
 {
-    logStream << "<Set search waveform (channel=" << (unsigned)channel << ", waveform=" << waveform << ")";
+    logStream << "<Open channel (channel=" << dec << (unsigned)channel << ", network=" << (unsigned)profile.network <<
+        ", type=" << (unsigned)profile.type << ", period=" << profile.period << ", timeout=" << (unsigned)profile.searchTimeout <<
+        ", frequency=24" << (unsigned)profile.frequency << "Mhz, waveform=" << profile.searchWaveform <<
+        ", deviceNum=" << profile.deviceNum << ", pairing=" << string(profile.pairing?"Yes":"No") <<
+        ", deviceType=" << (unsigned)profile.deviceType << ", transmissionType=" << (unsigned)profile.transmissionType << ")";
     logFlush();
 
+    // The stick handles commands in the order they arrive, so the whole
+    // profile is sent at once and the answers are collected afterwards
+    vector<pair<ANT_Message, vector<uint8_t> > > commands;
+
     vector<uint8_t> data;
-    data.push_back(channel);
-    uint8_t *bWaveform = (uint8_t *)&waveform;
-    data.push_back(bWaveform[0]);
-    data.push_back(bWaveform[1]);
-    if (!ANTMessage::sendMessage(sio, MSG_SetSearchWaveform, data))
-    {
-        return false;
-    }
-    if (!waitResponse(MSG_SetSearchWaveform))
-    {
-        return false;
-    }
+    data.push_back(profile.network);
+    data.insert(data.end(), profile.networkKey.begin(), profile.networkKey.end());
+    commands.push_back(make_pair(MSG_SetNetworkKey, data));
 
-    return true;
-}
+    uint8_t assign[] = { channel, (uint8_t)profile.type, profile.network };
+    commands.push_back(make_pair(MSG_AssignChannel, vector<uint8_t>(assign, assign+sizeof(assign))));
 
-bool ANT::setChannelId(uint8_t channel, uint16_t deviceNum, bool pairing,
-    uint8_t deviceType, uint8_t transmissionType)
-{
-    logStream << "<Set channel ID (channel=" << (unsigned)channel << ", deviceNum=" << deviceNum << ", pairing=" << string(pairing?"Yes":"No") <<
-        ", deviceType=" << (unsigned)deviceType << ", transmissionType=" << (unsigned)transmissionType << ")";
-    logFlush();
+    uint8_t period[] = { channel, (uint8_t)profile.period, (uint8_t)(profile.period >> 8) };
+    commands.push_back(make_pair(MSG_SetChannelPeriod, vector<uint8_t>(period, period+sizeof(period))));
 
-    struct DeviceTypeBits
-    {
-        uint8_t type:7;
-        uint8_t pairing:1;
-    };
+    uint8_t timeout[] = { channel, profile.searchTimeout };
+    commands.push_back(make_pair(MSG_SetChannelSearchTimeout, vector<uint8_t>(timeout, timeout+sizeof(timeout))));
 
-    union DeviceTypeU
-    {
-        DeviceTypeBits typeBits;
-        uint8_t type;
-    };
+    uint8_t frequency[] = { channel, profile.frequency };
+    commands.push_back(make_pair(MSG_SetChannelRadioFreq, vector<uint8_t>(frequency, frequency+sizeof(frequency))));
 
-    vector<uint8_t> data;
-    data.push_back(channel);
-    uint8_t *bDeviceNum = (uint8_t *)&deviceNum;
-    data.push_back(bDeviceNum[0]);
-    data.push_back(bDeviceNum[1]);
-    DeviceTypeU dtu;
-    dtu.typeBits.pairing = pairing;
-    dtu.typeBits.type = deviceType;
-    data.push_back(dtu.type);
-    data.push_back(transmissionType);
-    if (!ANTMessage::sendMessage(sio, MSG_SetChannelId, data))
-    {
-        return false;
-    }
-    if (!waitResponse(MSG_SetChannelId))
+    if (profile.searchWaveform)
     {
-        return false;
+        uint8_t waveform[] = { channel, (uint8_t)profile.searchWaveform, (uint8_t)(profile.searchWaveform >> 8) };
+        commands.push_back(make_pair(MSG_SetSearchWaveform, vector<uint8_t>(waveform, waveform+sizeof(waveform))));
     }
 
-    return true;
-}
+    uint8_t id[] = { channel, (uint8_t)profile.deviceNum, (uint8_t)(profile.deviceNum >> 8),
+        (uint8_t)((profile.deviceType & 0x7F) | (profile.pairing ? 0x80 : 0)), profile.transmissionType };
+    commands.push_back(make_pair(MSG_SetChannelId, vector<uint8_t>(id, id+sizeof(id))));
 
-bool ANT::openChannel(uint8_t channel)
-{
-    logStream << "<Open channel (channel=" << (unsigned)channel << ")";
-    logFlush();
+    uint8_t open[] = { channel };
+    commands.push_back(make_pair(MSG_OpenChannel, vector<uint8_t>(open, open+sizeof(open))));
 
-    vector<uint8_t> data;
-    data.push_back(channel);
-    if (!ANTMessage::sendMessage(sio, MSG_OpenChannel, data))
+    vector<ANTRequest> requests(commands.size());
+    size_t sent = 0;
+    while (sent < commands.size() && sendRequest(requests[sent], commands[sent].first, commands[sent].second))
     {
-        return false;
+        sent++;
     }
-    if (!waitResponse(MSG_OpenChannel))
+
+    // Every request sent is waited for, so none is left registered
+    bool rv = sent == commands.size();
+    for (size_t i=0; i<sent; i++)
     {
-        return false;
+        rv = waitRequest(requests[i]) && rv;
     }
 
-    return true;
+    return rv;
 }
 
 bool ANT::requestMessage(uint8_t channel, ANT_Message msgId)
@@ -883,24 +1416,29 @@ bool ANT::requestMessage(uint8_t channel, ANT_Message msgId)
             logStream << "(Capabilities)";
             break;
         }
+        default:
+        {
+            break;
+        }
     }
     logFlush();
 
-    messageId = MSG_Null;
+    ANTRequest answer;
+    ANTRequest refusal;
+    addRequest(answer, channel, msgId);
+    addRequest(refusal, channel, MSG_RequestMessage);
+
     vector<uint8_t> data;
     data.push_back(channel);
     data.push_back(msgId);
     if (!ANTMessage::sendMessage(sio, MSG_RequestMessage, data))
     {
+        removeRequest(answer);
+        removeRequest(refusal);
         return false;
     }
     
-    if (!waitMessage(msgId))
-    {
-        return false;
-    }
-
-    return true;
+    return waitMessage(answer, refusal);
 }
 
 bool ANT::sendAcknowledgedData(uint8_t channel, vector<uint8_t> &ackData)
@@ -931,7 +1469,18 @@ bool ANT::sendBurstTransferData(uint8_t channel, vector<uint8_t> &bData)
   //logStream << "<Send burst transfer data (channel=" << (unsigned)channel << "): " << GarminConvert::gHex(bData);
   //logFlush();
 
-    responseId = MSG_Null;
+    // A reception failure from before this request does not fail its answer
+    pthread_mutex_lock(&stateMutex);
+    burstFailed = false;
+    pthread_mutex_unlock(&stateMutex);
+
+    // Pacing comes from the stick: the first packet is held until the burst
+    // has started on air, the rest go out as fast as the serial port takes
+    // them, and a failure reported in between stops the transfer early
+    static const uint8_t startEvents[] = { EventTransferTXStart, EventTransferTXCompleted, EventTransferTXFailed };
+    static const uint8_t endEvents[] = { EventTransferTXCompleted, EventTransferTXFailed };
+    ANTRequest started;
+    ANTRequest finished;
 
 #pragma pack(1)
     struct D1Bits
@@ -967,12 +1516,46 @@ bool ANT::sendBurstTransferData(uint8_t channel, vector<uint8_t> &bData)
         dtu.d1Bits.last = last;
         data.push_back(dtu.d1u);
         data.insert(data.end(), itFrom, itTo);
-        if (!ANTMessage::sendMessage(sio, MSG_SendBurstTransferPacket, data))
+
+        uint8_t code;
+        if (sequence == 0)
+        {
+            // Events handled before the first packet is queued belong to an
+            // earlier transfer, such as a late TX_COMPLETED of an acknowledged
+            // message, so the requests are registered along with it
+            pthread_mutex_lock(&stateMutex);
+            insertEventRequest(started, channel, startEvents, sizeof(startEvents));
+            insertEventRequest(finished, channel, endEvents, sizeof(endEvents));
+            bool sent = ANTMessage::sendMessage(sio, MSG_SendBurstTransferPacket, data);
+            if (!sent)
+            {
+                eraseRequest(started);
+                eraseRequest(finished);
+            }
+            pthread_mutex_unlock(&stateMutex);
+
+            if (!sent)
+            {
+                return false;
+            }
+
+            if (!waitEvent(started, burstStartTimeout) || started.responseCode == EventTransferTXFailed)
+            {
+                logStream << "! Burst transfer did not start";
+                logFlush();
+                removeRequest(finished);
+                return false;
+            }
+        }
+        else if (!ANTMessage::sendMessage(sio, MSG_SendBurstTransferPacket, data))
         {
+            removeRequest(finished);
             return false;
         }
-        
-        usleep(burstSleepTime);
+        else if (!sio.flush() || (requestCompleted(finished, code) && code == EventTransferTXFailed))
+        {
+            break;
+        }
 
         if (++sequence > 3)
         {
@@ -980,6 +1563,13 @@ bool ANT::sendBurstTransferData(uint8_t channel, vector<uint8_t> &bData)
         }
     }
 
+    if (!waitEvent(finished, burstTimeout) || finished.responseCode != EventTransferTXCompleted)
+    {
+        logStream << "! Burst transfer failed";
+        logFlush();
+        return false;
+    }
+
     return true;
 }
 
@@ -19,16 +19,99 @@
  ***************************************************************************/
 
 #include "ANTPlus.h"
-#include "FIT.h"
+#include "CRC16.h"
+#include "DownloadCheckpoint.h"
 #include "GarminConvert.h"
 #include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <iostream>
 #include <iomanip>
 #include <fstream>
 #include <sstream>
 
+// Bounds for the block size requested from the watch
+const uint32_t minimumBlockSize = 512;
+const uint32_t initialBlockSize = 4096;
+const uint32_t maximumBlockSize = 65536;
+
+static double monotonicSeconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+ANTPlusDownloadBlock::ANTPlusDownloadBlock(vector<uint8_t> &file) :
+    file(file),
+    received(0)
+{
+    memset(&header, 0, sizeof(header));
+    memset(&footer, 0, sizeof(footer));
+}
+
+void ANTPlusDownloadBlock::burstReceived(const uint8_t *data, size_t len)
+{
+    const size_t dataStart = sizeof(header);
+
+    while (len > 0)
+    {
+        size_t n;
+        if (received < dataStart)
+        {
+            n = min(len, dataStart - received);
+            memcpy((uint8_t *)&header + received, data, n);
+
+            if (received + n == dataStart && header.response == DownloadResponseOk && file.size() < header.fileSize)
+            {
+                file.resize(header.fileSize);
+            }
+        }
+        else if (received < dataStart + header.dataRemain)
+        {
+            size_t pos = received - dataStart;
+            n = min(len, header.dataRemain - pos);
+
+            size_t at = header.dataOffset + pos;
+            if (at < file.size())
+            {
+                memcpy(&file[at], data, min(n, file.size() - at));
+            }
+        }
+        else
+        {
+            size_t pos = received - dataStart - header.dataRemain;
+            n = len;
+            if (pos < sizeof(footer))
+            {
+                n = min(len, sizeof(footer) - pos);
+                memcpy((uint8_t *)&footer + pos, data, n);
+            }
+        }
+
+        received += n;
+        data += n;
+        len -= n;
+    }
+}
+
+size_t ANTPlusDownloadBlock::dataReceived() const
+{
+    const size_t dataStart = sizeof(header);
+    if (received <= dataStart)
+    {
+        return 0;
+    }
+
+    return min(received - dataStart, (size_t)header.dataRemain);
+}
+
 ANTPlus::ANTPlus() :
-    maxAttempts(5)
+    maxAttempts(5),
+    blockSize(initialBlockSize),
+    blockSizeThreshold(maximumBlockSize),
+    currentUnitId(0)
 {
     downloadResponseCodesMap[DownloadResponseOk] = "Download Request Ok";
     downloadResponseCodesMap[DownloadResponseNotExist] = "Data does not exist";
@@ -50,6 +133,24 @@ void ANTPlus::leave(uint8_t channel)
     ANT::leave();
 }
 
+bool ANTPlus::sendCommand(uint8_t channel, uint8_t data[], unsigned len)
+{
+    // The outcome of an acknowledged command comes as a channel event in
+    // the same beacon period; listen for it before sending
+    static const uint8_t ackEvents[] = { EventTransferTXCompleted, EventTransferTXFailed };
+    ANTFuture ack(channel);
+    ack.accept(NotifyResponse, ackEvents, sizeof(ackEvents));
+    subscribe(ack);
+
+    if (!sendAcknowledgedData(channel, data, len))
+    {
+        unsubscribe(ack);
+        return false;
+    }
+
+    return wait(ack, responseTimeout) && ack.value == EventTransferTXCompleted;
+}
+
 bool ANTPlus::link(uint8_t channel, uint8_t freq, uint8_t beaconPeriod, uint32_t hostSN)
 {
     logStream << "# Link at frequency 24" << dec << setw(2) << setfill('0') << (unsigned)freq << " Mhz, beacon period=" << channelPeriodMap[beaconPeriod];
@@ -66,12 +167,9 @@ bool ANTPlus::link(uint8_t channel, uint8_t freq, uint8_t beaconPeriod, uint32_t
             cmd.param2 = beaconPeriod;
             cmd.hostSN = hostSN;
 
-            if (sendAcknowledgedData(channel, (uint8_t *)&cmd, sizeof(cmd)))
+            if (sendCommand(channel, (uint8_t *)&cmd, sizeof(cmd)))
             {
-                if (waitResponse(MSG_ChannelEvent))
-                {
-                    return true;
-                }
+                return true;
             }
         }
 
@@ -98,12 +196,9 @@ bool ANTPlus::disconnect(uint8_t channel, bool returnToBroadcast)
             cmd.param2 = 0;
             cmd.hostSN = 0;
 
-            if (sendAcknowledgedData(channel, (uint8_t *)&cmd, sizeof(cmd)))
+            if (sendCommand(channel, (uint8_t *)&cmd, sizeof(cmd)))
             {
-                if (waitResponse(MSG_ChannelEvent))
-                {
-                    return true;
-                }
+                return true;
             }
         }
 
@@ -130,21 +225,16 @@ bool ANTPlus::requestSN(uint8_t channel, uint32_t hostSN, string& unitName, uint
             cmd.param2 = 0;
             cmd.hostSN = hostSN;
 
-            if (sendAcknowledgedData(channel, (uint8_t *)&cmd, sizeof(cmd)))
+            if (sendCommand(channel, (uint8_t *)&cmd, sizeof(cmd)))
             {
-                if (waitResponse(MSG_ChannelEvent))
+                ANTPlusRequestSerialAnswer answer;
+                if (waitBurst((uint8_t *)&answer, sizeof(answer)))
                 {
-                    ANTPlusRequestSerialAnswer answer;
-                    if (waitBurst((uint8_t *)&answer, sizeof(answer)))
-                    {
-                        if (waitResponse(MSG_ChannelEvent))
-                        {
-                            unitId = answer.ans.unitId;
-                            unitName = GarminConvert::gString((uint8_t *)&answer.unitName, sizeof(answer.unitName));
+                    unitId = answer.ans.unitId;
+                    currentUnitId = unitId;
+                    unitName = GarminConvert::gString((uint8_t *)&answer.unitName, sizeof(answer.unitName));
 
-                            return true;
-                        }
-                    }
+                    return true;
                 }
             }
         }
@@ -182,15 +272,13 @@ bool ANTPlus::devicePair(uint8_t channel, uint32_t hostSN, string pcName, uint32
 
             if (sendBurstTransferData(channel, (uint8_t *)&cmd, sizeof(cmd)))
             {
-                if (waitResponse(MSG_ChannelEvent))
+                ANTPlusAuthenticateAnswer answer;
+                if (waitBurst((uint8_t *)&answer, sizeof(answer)))
                 {
-                    ANTPlusAuthenticateAnswer answer;
-                    if (waitBurst((uint8_t *)&answer, sizeof(answer)))
-                    {
-                        unitId = answer.ans.unitId;
-                        key = answer.key;
-                        return true;
-                    }
+                    unitId = answer.ans.unitId;
+                    currentUnitId = unitId;
+                    key = answer.key;
+                    return true;
                 }
             }
         }
@@ -222,15 +310,12 @@ bool ANTPlus::authenticate(uint8_t channel, uint32_t hostSN, uint64_t key)
 
             if (sendBurstTransferData(channel, (uint8_t *)&cmd, sizeof(cmd)))
             {
-                if (waitResponse(MSG_ChannelEvent))
+                ANTPlusAnswer answer = { 0 };
+                if (waitBurst((uint8_t *)&answer, sizeof(answer)))
                 {
-                    ANTPlusAnswer answer = { 0 };
-                    if (waitBurst((uint8_t *)&answer, sizeof(answer)))
-                    {
-                        logStream << "Authentication " << ((answer.responseType == AuthenticationAccepted)?"Accepted":"Rejected");
-                        logFlush();
-                        return true;
-                    }
+                    logStream << "Authentication " << ((answer.responseType == AuthenticationAccepted)?"Accepted":"Rejected");
+                    logFlush();
+                    return true;
                 }
             }
         }
@@ -243,21 +328,132 @@ bool ANTPlus::authenticate(uint8_t channel, uint32_t hostSN, uint64_t key)
     return true;
 }
 
-bool ANTPlus::download(uint8_t channel, uint16_t fileIndex, vector<uint8_t> &data)
+void ANTPlus::adaptBlockSize(bool burstComplete)
 {
-  logStream << "# Downloading file 0x" << hex << fileIndex << " (" << dec << fileIndex << ")";
-    logFlush();
+    // Large blocks amortize the request round trip on a clean link, small
+    // ones make a lost burst cheap on a poor one. Grow quickly until the
+    // first failure, then carefully around the size that last failed.
+    if (!burstComplete)
+    {
+        blockSizeThreshold = max((blockSize / 2) & ~7u, minimumBlockSize);
+        blockSize = blockSizeThreshold;
+    }
+    else if (blockSize < blockSizeThreshold)
+    {
+        blockSize = min(blockSize * 2, blockSizeThreshold);
+    }
+    else
+    {
+        blockSize = min(blockSize + minimumBlockSize, maximumBlockSize);
+    }
+}
+
+void ANTPlus::setCheckpointDirectory(const string &directory)
+{
+    if (::mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        logStream << "Error creating checkpoint directory " << directory << ", downloads will not be resumable";
+        logFlush();
+        return;
+    }
 
+    checkpointDirectory = directory;
+}
+
+bool ANTPlus::download(uint8_t channel, uint16_t fileIndex, vector<uint8_t> &data, uint32_t timeStamp, uint32_t directorySize, ANTPlusDownloadListener *listener)
+{
     data.clear();
 
+    return downloadRange(channel, fileIndex, data, timeStamp, directorySize, listener, 0);
+}
+
+bool ANTPlus::downloadHead(uint8_t channel, uint16_t fileIndex, uint32_t length, vector<uint8_t> &data)
+{
+    data.clear();
+
+    return downloadRange(channel, fileIndex, data, 0, 0, NULL, length);
+}
+
+bool ANTPlus::downloadTail(uint8_t channel, uint16_t fileIndex, vector<uint8_t> &data, uint32_t timeStamp, uint32_t directorySize, ANTPlusDownloadListener *listener)
+{
+    return downloadRange(channel, fileIndex, data, timeStamp, directorySize, listener, 0);
+}
+
+bool ANTPlus::downloadRange(uint8_t channel, uint16_t fileIndex, vector<uint8_t> &data, uint32_t timeStamp, uint32_t directorySize, ANTPlusDownloadListener *listener, uint32_t length)
+{
+  logStream << "# Downloading file 0x" << hex << fileIndex << " (" << dec << fileIndex << ")";
+    logFlush();
+
     uint16_t crc = 0;
     uint32_t offset = 0;
     uint16_t CRCseed = 0;
     uint32_t fileSize = 0;
     bool initialRequest = true;
 
+    // Data already held for the start of the file only needs its tail, the
+    // watch checks the CRC seed against its own copy of the start
+    if (!data.empty())
+    {
+        offset = data.size();
+        crc = CRC16::update(0, &data.front(), data.size());
+        CRCseed = crc;
+        initialRequest = false;
+
+        logStream << "Continuing at offset " << dec << offset;
+        logFlush();
+    }
+
+    // Files with a known directory entry continue from where an earlier
+    // session left them
+    DownloadCheckpoint checkpoint(checkpointDirectory, currentUnitId, fileIndex, timeStamp, directorySize);
+    bool resumable = !checkpointDirectory.empty() && timeStamp != 0 && directorySize != 0;
+    vector<uint8_t> saved;
+    bool resumed = resumable && checkpoint.load(saved, offset, CRCseed) && offset >= data.size();
+    if (resumed)
+    {
+        fileSize = directorySize;
+        data.swap(saved);
+        crc = CRCseed;
+        initialRequest = false;
+
+        logStream << "Resuming at offset " << dec << offset << "/" << fileSize;
+        logFlush();
+    }
+    else
+    {
+        offset = data.size();
+        fileSize = 0;
+        CRCseed = crc;
+    }
+
+    if (listener && offset > 0)
+    {
+        listener->downloadData(&data.front(), offset);
+    }
+
+    bool checkpointed = resumed;
+
+    int failures = 0;
+
+    uint32_t startOffset = offset;
+    uint32_t smallestBlock = 0;
+    uint32_t largestBlock = 0;
+    unsigned blocks = 0;
+    unsigned failedBursts = 0;
+    double startTime = monotonicSeconds();
+
     do
     {
+        if (failures >= maxAttempts)
+        {
+            logStream << "Giving up on file 0x" << hex << fileIndex << " at offset " << dec << offset << endl;
+            logFlush();
+
+            return false;
+        }
+
+        bool progress = false;
+
         if (waitBroadcast())
         {
             ANTPlusDownloadCommand cmd = { 0 };
@@ -268,115 +464,147 @@ bool ANTPlus::download(uint8_t channel, uint16_t fileIndex, vector<uint8_t> &dat
             cmd.initialRequest = initialRequest;
             cmd.unknown = 0;
             cmd.CRCseed = CRCseed;
-            cmd.maximumBlockSize = 0;
+            cmd.maximumBlockSize = length ? min(blockSize, length - offset) : blockSize;
 
-            vector<uint8_t> packetData;
+            ANTPlusDownloadBlock block(data);
             if (sendBurstTransferData(channel, (uint8_t *)&cmd, sizeof(cmd)))
             {
-                if (waitResponse(MSG_ChannelEvent))
+                bool complete = waitBurst(block);
+                if (!length)
                 {
-                    if (waitBurst(packetData))
+                    adaptBlockSize(complete);
+                }
+
+                blocks++;
+                failedBursts += complete ? 0 : 1;
+                smallestBlock = (blocks == 1) ? cmd.maximumBlockSize : min(smallestBlock, cmd.maximumBlockSize);
+                largestBlock = max(largestBlock, cmd.maximumBlockSize);
+                ANTPlusDownloadHeader &packetHeader = block.header;
+
+                if (block.size() < sizeof(packetHeader))
+                {
+                    if (complete)
                     {
-		      //logStream << "Burst packet size: " << dec << packetData.size();
-		      //logFlush();
-                        
-                        ANTPlusDownloadHeader packetHeader = { 0 };
-                        //logStream << "Header length: " << dec << sizeof(packetHeader);
-                        //logFlush();
-
-                        if (packetData.size() >= sizeof(packetHeader))
-                        {
-                            memcpy(&packetHeader, &packetData.front(), sizeof(packetHeader));
-                            packetData.erase(packetData.begin(), packetData.begin()+sizeof(packetHeader));
-                            //logStream << "Header: [" << GarminConvert::gHex((uint8_t*)&packetHeader, sizeof(packetHeader)) << "]";
-                            //logFlush();
-                            //logStream << "Response code: " << downloadResponseCodesMap[packetHeader.response] << "(" << dec << (unsigned)packetHeader.response << ")";
-                            //logFlush();
-                            //logStream << "Data bytes remain: " << dec << packetHeader.dataRemain;
-                            //logFlush();
-                            //logStream << "Data offset: " << dec << packetHeader.dataOffset;
-                            //logFlush();
-                            //logStream << "File size: " << dec << packetHeader.fileSize;
-			    //logReturn();
-			    
-			    int proc = (double)packetHeader.dataOffset/(double)packetHeader.fileSize*100;
-			    logStream << "Data: " << dec << setw(3) << proc << "% " << packetHeader.dataOffset << "/" << packetHeader.fileSize;
-                            logFlush();
-                        }
-                        else
-                        {
-                            logStream << "Packet data length " << dec << packetData.size() << " is too short to get header (" << sizeof(packetHeader) << " bytes)" << endl;
-                            logFlush();
+                        logStream << "Packet data length " << dec << block.size() << " is too short to get header (" << sizeof(packetHeader) << " bytes)" << endl;
+                        logFlush();
 
-                            return false;
-                        }
+                        return false;
+                    }
+                }
+                else if (packetHeader.response != DownloadResponseOk)
+                {
+                    logStream << "Download response: " << downloadResponseCodesMap[packetHeader.response] << " (" << dec << (unsigned)packetHeader.response << ")" << endl;
+                    logFlush();
 
-                        if (initialRequest)
-                        {
-                            fileSize = packetHeader.fileSize;
-                            if (fileSize == 0)
-                            {
-                                break;
-                            }
-                        }
-                        
-                        //logStream << "Data bytes remain in buffer: " << dec << packetData.size();
-                        //logFlush();
+                    if (resumed)
+                    {
+                        checkpoint.remove();
+                    }
 
-                        if (packetData.size() >= packetHeader.dataRemain)
-                        {
-                            FIT fit;
-                            for (int i=0; i<packetHeader.dataRemain; i++)
-                            {
-                                crc = fit.CRC_byte(crc, packetData[i]);
-                            }
-                            //logStream << "CRC: " << hex << uppercase << setw(4) << setfill('0') << crc;
-                            //logFlush();
-
-                            data.insert(data.end(), packetData.begin(), packetData.begin() + packetHeader.dataRemain);
-                            packetData.erase(packetData.begin(), packetData.begin() + packetHeader.dataRemain);
-
-                            offset += packetHeader.dataRemain;
-                            
-                            //logStream << "Offset=" << dec << offset;
-                            //logFlush();
-                        }
-                        else
+                    return false;
+                }
+                else if (initialRequest && packetHeader.fileSize == 0)
+                {
+                    break;
+                }
+                else if (packetHeader.dataOffset != offset || (size_t)packetHeader.dataOffset + packetHeader.dataRemain > data.size())
+                {
+                    logStream << "Packet data at " << dec << packetHeader.dataOffset << "+" << packetHeader.dataRemain << " does not fit the requested offset " << offset << " of " << data.size() << " bytes" << endl;
+                    logFlush();
+
+                    return false;
+                }
+                else
+                {
+                    // After a failed burst keep the payload that arrived
+                    // in order and continue the download right behind it
+                    size_t kept = block.dataReceived();
+                    if (complete && kept < packetHeader.dataRemain)
+                    {
+                        logStream << "Packet data length " << dec << kept << " is too short to get data (" << packetHeader.dataRemain << " bytes)" << endl;
+                        logFlush();
+
+                        return false;
+                    }
+
+                    if (fileSize == 0)
+                    {
+                        fileSize = packetHeader.fileSize;
+
+                        // A checkpoint is only sized right if the watch agrees
+                        // with its own directory
+                        resumable = resumable && fileSize == directorySize;
+                    }
+
+                    crc = CRC16::update(crc, &data[offset], kept);
+                    offset += kept;
+
+                    if (!complete)
+                    {
+                        logStream << "Burst interrupted after " << dec << kept << " of " << packetHeader.dataRemain << " bytes, resuming at offset " << offset;
+                        logFlush();
+
+                        CRCseed = crc;
+                    }
+                    else if (block.size() >= sizeof(packetHeader) + packetHeader.dataRemain + sizeof(block.footer))
+                    {
+                        CRCseed = block.footer.CRCseed;
+                    }
+                    else
+                    {
+                        logStream << "Packet data length " << dec << block.size() - sizeof(packetHeader) - packetHeader.dataRemain << " is too short to get footer (" << sizeof(block.footer) << " bytes)" << endl;
+                        logFlush();
+
+                        return false;
+                    }
+
+			int proc = (double)offset/(double)fileSize*100;
+			logStream << "Data: " << dec << setw(3) << proc << "% " << offset << "/" << fileSize;
+                    logFlush();
+
+                    if (kept > 0)
+                    {
+                        if (resumable)
                         {
-                            logStream << "Packet data length " << dec << packetData.size() << " is too short to get data (" << packetHeader.dataRemain << " bytes)" << endl;
-                            logFlush();
-                            
-                            return false;
+                            // The first save also covers data held before
+                            checkpoint.save(data, checkpointed ? offset - kept : 0, offset, CRCseed);
+                            checkpointed = true;
                         }
-                        
-                        ANTPlusDownloadFooter packetFooter;
-                        if (packetData.size() >= sizeof(packetFooter))
-                        {
-                            memcpy(&packetFooter, &packetData.front(), sizeof(packetFooter));
-                            packetData.erase(packetData.begin(), packetData.begin() + sizeof(packetFooter));
 
-                            CRCseed = packetFooter.CRCseed;
-                            //logStream << "CRCseed: " << hex << uppercase << setw(4) << setfill('0') << CRCseed;
-                            //logFlush();
-                        }
-                        else
+                        if (listener)
                         {
-                            logStream << "Packet data length " << dec << packetData.size() << " is too short to get footer (" << sizeof(packetFooter) << " bytes)" << endl;
-                            logFlush();
-                            
-                            return false;
+                            listener->downloadData(&data[offset - kept], kept);
                         }
-
-                        initialRequest = false;
                     }
+
+                    initialRequest = false;
+                    progress = kept > 0;
                 }
             }
         }
+
+        failures = progress ? 0 : failures + 1;
+    }
+    while(fileSize == 0 || offset < (length ? min(length, fileSize) : fileSize));
+
+    data.resize(offset);
+
+    if (resumable)
+    {
+        checkpoint.remove();
     }
-    while(data.size() < fileSize);
 
     logStream << "Data size: " << dec << data.size();
     logFlush();
+
+    double elapsed = monotonicSeconds() - startTime;
+    if (elapsed > 0 && offset > startOffset)
+    {
+        logStream << "Transferred " << dec << offset - startOffset << " bytes in " << (unsigned)(elapsed * 1000) << " ms (" <<
+            (unsigned)((offset - startOffset) / elapsed) << " bytes/s), " << blocks << " blocks of " <<
+            smallestBlock << ".." << largestBlock << " bytes, " << failedBursts << " failed";
+        logFlush();
+    }
 /*    
     std::stringstream fileName;
     fileName << "ANTFile#";
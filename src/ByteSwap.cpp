@@ -0,0 +1,146 @@
+/***************************************************************************
+ *   Copyright (C) 2010-2012 by Oleg Khudyakov                             *
+ *   prcoder@gmail.com                                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "ByteSwap.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <tmmintrin.h>
+#define BYTE_SWAP_SSSE3
+#endif
+
+#ifdef BYTE_SWAP_SSSE3
+__attribute__((target("ssse3")))
+static void shuffleBlock(const uint8_t *in, const uint8_t *mask, uint8_t *out)
+{
+    __m128i data = _mm_loadu_si128((const __m128i *)in);
+    __m128i order = _mm_loadu_si128((const __m128i *)mask);
+    _mm_storeu_si128((__m128i *)out, _mm_shuffle_epi8(data, order));
+}
+
+static bool detectSSSE3()
+{
+    // Runs from a static initializer, before the compiler's own CPU detection
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+}
+
+static const bool haveSSSE3 = detectSSSE3();
+#endif
+
+ByteSwapPlan::ByteSwapPlan() :
+    swapping(false)
+{
+}
+
+void ByteSwapPlan::clear()
+{
+    source.clear();
+    masks.clear();
+    inBlock.clear();
+    swapping = false;
+}
+
+void ByteSwapPlan::addField(size_t size, size_t elementSize)
+{
+    // Fields that are no whole number of elements are left as they are
+    if (elementSize < 2 || size % elementSize)
+    {
+        elementSize = 1;
+    }
+
+    size_t start = source.size();
+    for (size_t i=0; i<size; i++)
+    {
+        size_t element = i - i % elementSize;
+        source.push_back(start + element + elementSize - 1 - i % elementSize);
+    }
+
+    swapping = swapping || elementSize > 1;
+}
+
+size_t ByteSwapPlan::size() const
+{
+    return source.size();
+}
+
+bool ByteSwapPlan::swaps() const
+{
+    return swapping;
+}
+
+void ByteSwapPlan::finish()
+{
+    // A block can be shuffled in one go when none of its bytes come from
+    // a field that straddles the block boundary
+    size_t blocks = source.size() / BlockSize;
+    masks.assign(blocks * BlockSize, 0);
+    inBlock.assign(blocks, 1);
+
+    for (size_t b=0; b<blocks; b++)
+    {
+        for (size_t i=0; i<BlockSize; i++)
+        {
+            size_t from = source[b * BlockSize + i];
+            if (from / BlockSize != b)
+            {
+                inBlock[b] = 0;
+                break;
+            }
+            masks[b * BlockSize + i] = from % BlockSize;
+        }
+    }
+}
+
+void ByteSwapPlan::apply(const uint8_t *in, uint8_t *out) const
+{
+    if (!swapping)
+    {
+        memcpy(out, in, source.size());
+        return;
+    }
+
+    size_t i = 0;
+#ifdef BYTE_SWAP_SSSE3
+    if (haveSSSE3)
+    {
+        for (size_t b=0; b<inBlock.size(); b++)
+        {
+            if (inBlock[b])
+            {
+                shuffleBlock(in + i, &masks[i], out + i);
+                i += BlockSize;
+                continue;
+            }
+
+            for (size_t end = i + BlockSize; i < end; i++)
+            {
+                out[i] = in[source[i]];
+            }
+        }
+    }
+#endif
+
+    for (; i<source.size(); i++)
+    {
+        out[i] = in[source[i]];
+    }
+}
@@ -0,0 +1,81 @@
+/***************************************************************************
+ *   Copyright (C) 2010-2012 by Oleg Khudyakov                             *
+ *   prcoder@gmail.com                                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "CRC16.h"
+
+// Slice-by-8 tables: table[0] is the classic byte-wise table, table[k] gives
+// the contribution of a byte that still has k more bytes to pass through the
+// register. Eight bytes are then folded in with eight independent lookups.
+static uint16_t table[8][256];
+
+static struct CRC16Tables
+{
+    CRC16Tables()
+    {
+        for (unsigned i = 0; i < 256; i++)
+        {
+            uint16_t crc = i;
+            for (int bit = 0; bit < 8; bit++)
+            {
+                crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+            }
+            table[0][i] = crc;
+        }
+
+        for (unsigned i = 0; i < 256; i++)
+        {
+            for (int k = 1; k < 8; k++)
+            {
+                uint16_t crc = table[k-1][i];
+                table[k][i] = (crc >> 8) ^ table[0][crc & 0xFF];
+            }
+        }
+    }
+} crc16Tables;
+
+uint16_t CRC16::update(uint16_t crc, uint8_t byte)
+{
+    return (crc >> 8) ^ table[0][(crc ^ byte) & 0xFF];
+}
+
+uint16_t CRC16::update(uint16_t crc, const uint8_t *data, size_t len)
+{
+    while (len >= 8)
+    {
+        crc = table[7][(data[0] ^ crc) & 0xFF] ^
+              table[6][data[1] ^ (crc >> 8)] ^
+              table[5][data[2]] ^
+              table[4][data[3]] ^
+              table[3][data[4]] ^
+              table[2][data[5]] ^
+              table[1][data[6]] ^
+              table[0][data[7]];
+        data += 8;
+        len -= 8;
+    }
+
+    while (len > 0)
+    {
+        crc = (crc >> 8) ^ table[0][(crc ^ *data++) & 0xFF];
+        len--;
+    }
+
+    return crc;
+}
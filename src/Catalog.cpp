@@ -0,0 +1,249 @@
+/***************************************************************************
+ *   Copyright (C) 2010-2012 by Oleg Khudyakov                             *
+ *   prcoder@gmail.com                                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "Catalog.h"
+#include "FIT.h"
+#include "Log.h"
+
+#include <stdio.h>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+
+Catalog::Catalog(const string &fileName, size_t batchSize) :
+    fileName(fileName),
+    batchSize(batchSize),
+    pending(0)
+{
+    pthread_mutex_init(&mutex, NULL);
+}
+
+Catalog::~Catalog()
+{
+    commit();
+    pthread_mutex_destroy(&mutex);
+}
+
+bool Catalog::load()
+{
+    ifstream file(fileName.c_str());
+    if (!file)
+    {
+        return false;
+    }
+
+    pthread_mutex_lock(&mutex);
+    string line;
+    while (getline(file, line))
+    {
+        istringstream fields(line);
+        string tag;
+        fields >> tag;
+        if (tag == "F")
+        {
+            // Catalogs written before CRCs were kept end after the size
+            CatalogEntry entry;
+            uint16_t crc = 0;
+            if (fields >> entry.unitId >> entry.fileIndex >> entry.timeStamp >> entry.fileSize)
+            {
+                fields >> crc;
+                insert(entry, crc);
+            }
+        }
+        else if (tag == "D")
+        {
+            uint32_t unitId, modifiedTime;
+            if (fields >> unitId >> modifiedTime)
+            {
+                directoryTimes[unitId] = modifiedTime;
+            }
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+
+    return true;
+}
+
+size_t Catalog::size()
+{
+    pthread_mutex_lock(&mutex);
+    size_t rv = entries.size();
+    pthread_mutex_unlock(&mutex);
+
+    return rv;
+}
+
+bool Catalog::contains(const CatalogEntry &entry)
+{
+    pthread_mutex_lock(&mutex);
+    bool rv = entries.count(entry) > 0;
+    pthread_mutex_unlock(&mutex);
+
+    return rv;
+}
+
+void Catalog::add(const CatalogEntry &entry, uint16_t crc)
+{
+    pthread_mutex_lock(&mutex);
+    if (insert(entry, crc) && ++pending >= batchSize)
+    {
+        write();
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+bool Catalog::previous(uint32_t unitId, uint16_t fileIndex, CatalogEntry &entry, uint16_t &crc)
+{
+    pthread_mutex_lock(&mutex);
+    unordered_map<uint64_t, CatalogEntry>::const_iterator it = latest.find(((uint64_t)unitId << 16) | fileIndex);
+    bool rv = it != latest.end();
+    if (rv)
+    {
+        entry = it->second;
+        crc = entries[entry];
+    }
+    pthread_mutex_unlock(&mutex);
+
+    return rv;
+}
+
+bool Catalog::insert(const CatalogEntry &entry, uint16_t crc)
+{
+    // Called with mutex held. Remembers the most recent version of each
+    // file index, which is the one a grown file continues.
+    pair<unordered_map<CatalogEntry, uint16_t, CatalogEntryHash>::iterator, bool> inserted = entries.insert(make_pair(entry, crc));
+    if (!inserted.second && inserted.first->second == crc)
+    {
+        return false;
+    }
+    inserted.first->second = crc;
+
+    CatalogEntry &last = latest.insert(make_pair(((uint64_t)entry.unitId << 16) | entry.fileIndex, entry)).first->second;
+    if (entry.timeStamp > last.timeStamp || (entry.timeStamp == last.timeStamp && entry.fileSize > last.fileSize))
+    {
+        last = entry;
+    }
+
+    return true;
+}
+
+bool Catalog::directoryTime(uint32_t unitId, uint32_t &modifiedTime)
+{
+    pthread_mutex_lock(&mutex);
+    unordered_map<uint32_t, uint32_t>::const_iterator it = directoryTimes.find(unitId);
+    bool rv = it != directoryTimes.end();
+    if (rv)
+    {
+        modifiedTime = it->second;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    return rv;
+}
+
+void Catalog::setDirectoryTime(uint32_t unitId, uint32_t modifiedTime)
+{
+    pthread_mutex_lock(&mutex);
+    directoryTimes[unitId] = modifiedTime;
+    pending++;
+    pthread_mutex_unlock(&mutex);
+}
+
+bool Catalog::commit()
+{
+    pthread_mutex_lock(&mutex);
+    bool rv = (pending == 0) || write();
+    pthread_mutex_unlock(&mutex);
+
+    return rv;
+}
+
+bool Catalog::write()
+{
+    // Called with mutex held. Readers of the file see either the old or the
+    // new catalog, never a partly written one.
+    string tmpName = fileName + ".tmp";
+    ofstream file(tmpName.c_str(), ios::out | ios::trunc);
+    for (unordered_map<CatalogEntry, uint16_t, CatalogEntryHash>::const_iterator it = entries.begin(); it != entries.end(); ++it)
+    {
+        const CatalogEntry &entry = it->first;
+        file << "F " << entry.unitId << " " << entry.fileIndex << " " << entry.timeStamp << " " << entry.fileSize << " " << it->second << "\n";
+    }
+    for (unordered_map<uint32_t, uint32_t>::const_iterator it = directoryTimes.begin(); it != directoryTimes.end(); ++it)
+    {
+        file << "D " << it->first << " " << it->second << "\n";
+    }
+    file.close();
+
+    if (!file || ::rename(tmpName.c_str(), fileName.c_str()) != 0)
+    {
+        logStream << "Error writing catalog " << fileName;
+        logFlush();
+        return false;
+    }
+
+    pending = 0;
+    return true;
+}
+
+void Catalog::importLegacy(const string &legacyFileName, uint32_t unitId, ZeroFileContent &directory)
+{
+    // The old list only has file indices. Take them to mean the files that
+    // currently carry these indices on this unit, which is what the old
+    // update mode assumed as well.
+    ifstream legacy(legacyFileName.c_str());
+    if (!legacy)
+    {
+        return;
+    }
+
+    istream_iterator<int> start(legacy), end;
+    vector<int> indices(start, end);
+    legacy.close();
+
+    size_t imported = 0;
+    for (size_t i=0; i<indices.size(); i++)
+    {
+        map<uint16_t, ZeroFileRecord>::iterator it = directory.records.find(indices[i]);
+        if (it == directory.records.end())
+        {
+            continue;
+        }
+
+        CatalogEntry entry = { unitId, it->second.index, it->second.timeStamp, it->second.fileSize };
+        pthread_mutex_lock(&mutex);
+        if (entries.count(entry) == 0)
+        {
+            insert(entry, 0);
+            imported++;
+        }
+        pending++;
+        pthread_mutex_unlock(&mutex);
+    }
+
+    if (commit())
+    {
+        string migratedName = legacyFileName + ".migrated";
+        ::rename(legacyFileName.c_str(), migratedName.c_str());
+
+        logStream << "Imported " << imported << " of " << indices.size() << " entries from " << legacyFileName;
+        logFlush();
+    }
+}
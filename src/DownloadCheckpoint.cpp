@@ -0,0 +1,138 @@
+/***************************************************************************
+ *   Copyright (C) 2010-2012 by Oleg Khudyakov                             *
+ *   prcoder@gmail.com                                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "DownloadCheckpoint.h"
+#include "Log.h"
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+
+static bool writeFile(const string &name, int flags, const uint8_t *ptr, size_t len, off_t pos)
+{
+    int fd = ::open(name.c_str(), flags, 0644);
+    if (fd == -1)
+    {
+        return false;
+    }
+
+    while (len > 0)
+    {
+        ssize_t written = ::pwrite(fd, ptr, len, pos);
+        if (written <= 0)
+        {
+            break;
+        }
+        ptr += written;
+        pos += written;
+        len -= written;
+    }
+    bool rv = len == 0 && ::fsync(fd) == 0;
+    ::close(fd);
+
+    return rv;
+}
+
+DownloadCheckpoint::DownloadCheckpoint(const string &directory, uint32_t unitId, uint16_t fileIndex, uint32_t timeStamp, uint32_t fileSize) :
+    fileIndex(fileIndex),
+    timeStamp(timeStamp),
+    fileSize(fileSize)
+{
+    stringstream name;
+    name << directory << "/" << dec << unitId << "-" << hex << uppercase << setw(4) << setfill('0') << fileIndex;
+
+    partName = name.str() + ".part";
+    resumeName = name.str() + ".resume";
+}
+
+bool DownloadCheckpoint::load(vector<uint8_t> &data, uint32_t &offset, uint16_t &CRCseed)
+{
+    ifstream resume(resumeName.c_str());
+    if (!resume)
+    {
+        return false;
+    }
+
+    // The buffer is sized from the directory entry, never from the record
+    unsigned index, seed;
+    uint32_t stamp, recordSize, end;
+    resume >> index >> stamp >> recordSize >> end >> seed;
+    if (!resume || index != fileIndex || stamp != timeStamp || recordSize != fileSize || end > fileSize)
+    {
+        logStream << "Discarding stale checkpoint " << resumeName;
+        logFlush();
+        remove();
+        return false;
+    }
+
+    ifstream part(partName.c_str(), ios::in | ios::binary);
+    data.assign(fileSize, 0);
+    if (end > 0 && !part.read((char *)&data.front(), end))
+    {
+        logStream << "Checkpoint " << partName << " is shorter than " << dec << end << " bytes";
+        logFlush();
+        data.clear();
+        remove();
+        return false;
+    }
+
+    offset = end;
+    CRCseed = seed;
+
+    return true;
+}
+
+bool DownloadCheckpoint::save(const vector<uint8_t> &data, uint32_t from, uint32_t offset, uint16_t CRCseed)
+{
+    // The payload goes to disk before the resume record that points past it,
+    // so a crash in between only loses the last block
+    const uint8_t *ptr = (offset > from) ? &data[from] : NULL;
+    if (!writeFile(partName, O_WRONLY | O_CREAT, ptr, offset - from, from))
+    {
+        logStream << "Error writing checkpoint " << partName;
+        logFlush();
+        return false;
+    }
+
+    stringstream record;
+    record << fileIndex << " " << timeStamp << " " << fileSize << " " << offset << " " << CRCseed << endl;
+    string recordData = record.str();
+
+    // Replaced by rename only once the new record is on disk
+    string tmpName = resumeName + ".tmp";
+    if (!writeFile(tmpName, O_WRONLY | O_CREAT | O_TRUNC, (const uint8_t *)recordData.data(), recordData.size(), 0) ||
+        ::rename(tmpName.c_str(), resumeName.c_str()) != 0)
+    {
+        logStream << "Error writing checkpoint " << resumeName;
+        logFlush();
+        return false;
+    }
+
+    return true;
+}
+
+void DownloadCheckpoint::remove()
+{
+    ::unlink(resumeName.c_str());
+    ::unlink(partName.c_str());
+}
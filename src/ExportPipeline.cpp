@@ -0,0 +1,222 @@
+/***************************************************************************
+ *   Copyright (C) 2010-2012 by Oleg Khudyakov                             *
+ *   prcoder@gmail.com                                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "ExportPipeline.h"
+#include "CRC16.h"
+#include "Log.h"
+
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sstream>
+
+ActivityParser::ActivityParser(FIT &fit) :
+    decoder(fit, gpx),
+    failed(false)
+{
+}
+
+void ActivityParser::downloadData(const uint8_t *data, size_t len)
+{
+    if (!failed && !decoder.feed(data, len))
+    {
+        failed = true;
+    }
+}
+
+bool ActivityParser::finish()
+{
+    return !failed && decoder.finish();
+}
+
+static void swapGPX(GPX &a, GPX &b)
+{
+    a.wayPoints.swap(b.wayPoints);
+    a.tracks.swap(b.tracks);
+}
+
+ExportPipeline::ExportPipeline(Catalog &catalog, size_t capacity, unsigned workers) :
+    capacity(capacity),
+    workers(workers),
+    finishing(false),
+    catalog(catalog)
+{
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&jobAvailable, NULL);
+    pthread_cond_init(&spaceAvailable, NULL);
+}
+
+ExportPipeline::~ExportPipeline()
+{
+    finish();
+
+    pthread_cond_destroy(&spaceAvailable);
+    pthread_cond_destroy(&jobAvailable);
+    pthread_mutex_destroy(&mutex);
+}
+
+bool ExportPipeline::start()
+{
+    ::mkdir("activities", 0755);
+    ::mkdir("activities/raw", 0755);
+
+    for (unsigned i=0; i<workers; i++)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, (void*(*)(void*))workerThread, this) != 0)
+        {
+            logStream << "Error creating export thread";
+            logFlush();
+            finish();
+            return false;
+        }
+        threads.push_back(thread);
+    }
+
+    return true;
+}
+
+void ExportPipeline::push(const CatalogEntry &entry, GPX &gpx, uint16_t crc, vector<uint8_t> *raw)
+{
+    pthread_mutex_lock(&mutex);
+    while (jobs.size() >= capacity)
+    {
+        pthread_cond_wait(&spaceAvailable, &mutex);
+    }
+
+    jobs.push_back(ExportJob());
+    jobs.back().entry = entry;
+    jobs.back().crc = crc;
+    swapGPX(jobs.back().gpx, gpx);
+    if (raw)
+    {
+        jobs.back().raw.swap(*raw);
+    }
+    pthread_cond_signal(&jobAvailable);
+    pthread_mutex_unlock(&mutex);
+}
+
+void ExportPipeline::finish()
+{
+    pthread_mutex_lock(&mutex);
+    finishing = true;
+    pthread_cond_broadcast(&jobAvailable);
+    pthread_mutex_unlock(&mutex);
+
+    for (size_t i=0; i<threads.size(); i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    threads.clear();
+}
+
+bool ExportPipeline::pop(ExportJob &job)
+{
+    pthread_mutex_lock(&mutex);
+    while (jobs.empty() && !finishing)
+    {
+        pthread_cond_wait(&jobAvailable, &mutex);
+    }
+
+    if (jobs.empty())
+    {
+        pthread_mutex_unlock(&mutex);
+        return false;
+    }
+
+    job.entry = jobs.front().entry;
+    job.crc = jobs.front().crc;
+    swapGPX(job.gpx, jobs.front().gpx);
+    job.raw.clear();
+    job.raw.swap(jobs.front().raw);
+    jobs.pop_front();
+    pthread_cond_signal(&spaceAvailable);
+    pthread_mutex_unlock(&mutex);
+
+    return true;
+}
+
+void* ExportPipeline::workerThread(ExportPipeline *pipeline)
+{
+    ExportJob job;
+    while (pipeline->pop(job))
+    {
+        pipeline->process(job);
+    }
+
+    return NULL;
+}
+
+void ExportPipeline::process(ExportJob &job)
+{
+    // Store the track immediately:
+    stringstream sstm;
+    sstm << "activities/track" << (int)job.entry.fileIndex << ".gpx";
+    job.gpx.writeToFile(sstm.str());
+
+    // Keep the content the next tail download continues, replacing the
+    // file atomically so it always matches a catalog entry:
+    if (!job.raw.empty())
+    {
+        string fileName = archiveName(job.entry);
+        string tmpName = fileName + ".tmp";
+        ofstream file(tmpName.c_str(), ios::out | ios::binary | ios::trunc);
+        file.write((const char*)&job.raw.front(), job.raw.size());
+        file.close();
+
+        if (!file || ::rename(tmpName.c_str(), fileName.c_str()) != 0)
+        {
+            logStream << "Error archiving activity file 0x" << hex << job.entry.fileIndex;
+            logFlush();
+        }
+    }
+
+    // This activity has been received, store that information:
+    catalog.add(job.entry, job.crc);
+
+    logStream << "# Exported activity file 0x" << hex << job.entry.fileIndex;
+    logFlush();
+}
+
+string ExportPipeline::archiveName(const CatalogEntry &entry)
+{
+    stringstream sstm;
+    sstm << "activities/raw/" << entry.unitId << "-" << entry.fileIndex << ".fit";
+    return sstm.str();
+}
+
+bool ExportPipeline::loadArchive(const CatalogEntry &entry, uint16_t crc, vector<uint8_t> &data)
+{
+    // Only a copy that still matches the catalog entry may be continued
+    ifstream file(archiveName(entry).c_str(), ios::in | ios::binary);
+    if (!file)
+    {
+        return false;
+    }
+
+    data.resize(entry.fileSize);
+    if (entry.fileSize == 0 || !file.read((char*)&data.front(), entry.fileSize) ||
+        file.peek() != EOF || CRC16::update(0, &data.front(), data.size()) != crc)
+    {
+        data.clear();
+        return false;
+    }
+
+    return true;
+}
@@ -19,11 +19,15 @@
  ***************************************************************************/
 
 #include "FIT.h"
+#include "CRC16.h"
 #include <time.h>
+#include <stddef.h>
 #include <string.h>
 #include <sstream>
 #include <iomanip>
 #include <map>
+#include <unordered_map>
+#include <pthread.h>
 
 #include <iostream> // DEBUG
 
@@ -618,26 +622,20 @@ FIT::~FIT()
 {
 }
 
-uint16_t FIT::CRC_byte(uint16_t crc, uint8_t byte)
+// Field values are not aligned within records
+template <typename T> static inline T load(const uint8_t *ptr)
 {
-    static const uint16_t crc_table[16] =
-    {
-        0x0000, 0xCC01, 0xD801, 0x1400, 0xF001, 0x3C00, 0x2800, 0xE401,
-        0xA001, 0x6C00, 0x7800, 0xB401, 0x5000, 0x9C01, 0x8801, 0x4400
-    };
-
-    uint16_t tmp = crc_table[crc & 0xF];
-    crc = (crc >> 4) & 0x0FFF;
-    crc = crc ^ tmp ^ crc_table[byte & 0xF];
-
-    tmp = crc_table[crc & 0xF];
-    crc = (crc >> 4) & 0x0FFF;
-    crc = crc ^ tmp ^ crc_table[(byte >> 4) & 0xF];
+    T value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
 
-    return crc;
+uint16_t FIT::CRC_byte(uint16_t crc, uint8_t byte)
+{
+    return CRC16::update(crc, byte);
 }
 
-string FIT::getDataString(uint8_t *ptr, uint8_t size, uint8_t baseType, uint8_t messageType, uint8_t fieldNum)
+string FIT::getDataString(const uint8_t *ptr, uint8_t size, uint8_t baseType, uint8_t messageType, uint8_t fieldNum)
 {
     ostringstream strstrm;
     strstrm.setf(ios::fixed,ios::floatfield);
@@ -650,7 +648,7 @@ string FIT::getDataString(uint8_t *ptr, uint8_t size, uint8_t baseType, uint8_t
     {
         case BT_Enum:
         {
-            int val = *(int8_t *)ptr;
+            int val = load<int8_t>(ptr);
             uint8_t type = messageFieldTypeMap[messageType][fieldNum];
             string strVal(enumMap[type][val]);
 
@@ -666,14 +664,14 @@ string FIT::getDataString(uint8_t *ptr, uint8_t size, uint8_t baseType, uint8_t
         }
         case BT_Int8:
         {
-            int val = *(int8_t *)ptr;
+            int val = load<int8_t>(ptr);
             strstrm << dec << val;
             break;
         }
         case BT_UInt8:
         case BT_Uint8z:
         {
-            unsigned val = *(uint8_t *)ptr;
+            unsigned val = load<uint8_t>(ptr);
             if (val == 0xFF)
             {
                 strstrm << "undefined";
@@ -686,7 +684,7 @@ string FIT::getDataString(uint8_t *ptr, uint8_t size, uint8_t baseType, uint8_t
         }
         case BT_Int16:
         {
-            int16_t val = *(int16_t *)ptr;
+            int16_t val = load<int16_t>(ptr);
             if (val == 0x7FFF)
             {
                 strstrm << "undefined";
@@ -700,7 +698,7 @@ string FIT::getDataString(uint8_t *ptr, uint8_t size, uint8_t baseType, uint8_t
         case BT_Uint16:
         case BT_Uint16z:
         {
-            uint16_t val = *(uint16_t *)ptr;
+            uint16_t val = load<uint16_t>(ptr);
             if (val == 0xFFFF)
             {
                 strstrm << "undefined";
@@ -745,7 +743,7 @@ string FIT::getDataString(uint8_t *ptr, uint8_t size, uint8_t baseType, uint8_t
         }
         case BT_Int32:
         {
-            int32_t val = *(int32_t *)ptr;
+            int32_t val = load<int32_t>(ptr);
             if (val == 0x7FFFFFFF)
             {
                 strstrm << "undefined";
@@ -770,7 +768,7 @@ string FIT::getDataString(uint8_t *ptr, uint8_t size, uint8_t baseType, uint8_t
         case BT_UInt32:
         case BT_Uint32z:
         {
-            uint32_t val = *(uint32_t *)ptr;
+            uint32_t val = load<uint32_t>(ptr);
             if (val == 0xFFFFFFFF)
             {
                 strstrm << "undefined";
@@ -819,306 +817,577 @@ string FIT::getDataString(uint8_t *ptr, uint8_t size, uint8_t baseType, uint8_t
     return strstrm.str();
 }
 
-bool FIT::parse(vector<uint8_t> &fitData, GPX &gpx)
+bool FIT::parse(const uint8_t *fitData, size_t len, GPX &gpx)
 {
-    logStream << "Parsing FIT file";
-    logFlush();
-    
-    //FILE *f=fopen("debug.FIT", "wb");
-    //fwrite(&fitData[0], fitData.size(), 1 , f);
-    //fclose(f);    
+    FITDecoder decoder(*this, gpx);
+    if (len > 0 && !decoder.feed(fitData, len))
+    {
+        return false;
+    }
 
-    uint8_t *ptr = &fitData.front();
+    return decoder.finish();
+}
+
+bool FIT::parse(const vector<uint8_t> &fitData, GPX &gpx)
+{
+    return parse(fitData.empty() ? NULL : &fitData.front(), fitData.size(), gpx);
+}
 
-    FITHeader fitHeader;
-    memcpy(&fitHeader, ptr, sizeof(fitHeader));
+// Fields the decoder makes use of, by message and field number. Everything
+// else in a definition is left out of its plan.
+struct PlanTarget
+{
+    uint16_t globalNum;
+    uint8_t definitionNum;
+    uint8_t column;
+    uint8_t converter;
+};
 
-    // FIT header CRC
-    uint16_t crc = 0;
-    for (int i = 0; i < fitHeader.headerSize; i++)
+static const PlanTarget planTargets[] =
+{
+    { 0, 0, ColumnFileType, ConvertInt8 },
+    { 0, 4, ColumnFileCreationTime, ConvertUInt32 },
+    { 18, 253, ColumnLog, ConvertNone },
+    { 18, 9, ColumnLog, ConvertNone },
+    { 20, 253, ColumnPointTime, ConvertUInt32 },
+    { 20, 0, ColumnPointLatitude, ConvertInt32 },
+    { 20, 1, ColumnPointLongitude, ConvertInt32 },
+    { 20, 2, ColumnPointAltitude, ConvertUInt16 },
+    { 20, 3, ColumnPointHeartRate, ConvertUInt8 },
+    { 20, 4, ColumnPointCadence, ConvertUInt8 },
+    { 29, 253, ColumnWayPointTime, ConvertUInt32 },
+    { 29, 0, ColumnWayPointName, ConvertNone },
+    { 29, 1, ColumnWayPointLatitude, ConvertInt32 },
+    { 29, 2, ColumnWayPointLongitude, ConvertInt32 },
+    { 29, 4, ColumnWayPointAltitude, ConvertUInt16 },
+    { 31, 5, ColumnCourseName, ConvertNone }
+};
+
+static const uint8_t converterWidth[] = { 0, 1, 1, 2, 4, 4 };
+
+// Element size of each base type, for byte order conversion
+static const uint8_t baseTypeSize[] = { 1, 1, 1, 2, 2, 4, 4, 1, 4, 8, 1, 2, 4, 1 };
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+static const uint8_t hostArchitecture = ArchitectureBigEndian;
+#else
+static const uint8_t hostArchitecture = ArchitectureLittleEndian;
+#endif
+
+// Plans compiled so far in this process. A device writes the same
+// definitions into every file, so a batch of files compiles each layout
+// once. Entries are never removed, plans stay where they are.
+static const size_t planCacheSize = 1024;
+static unordered_map<string, DecodePlan> planCache;
+static pthread_mutex_t planCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+
+void FIT::decodeDefinition(const uint8_t *ptr, RecordDef &rd)
+{
+    memcpy(&rd.rfx, ptr, sizeof(rd.rfx));
+    const RecordField *fields = (const RecordField *)(ptr + sizeof(rd.rfx));
+    if (rd.rfx.arch != hostArchitecture)
     {
-        crc = CRC_byte(crc, *(ptr+i));
+        rd.rfx.globalNum = (rd.rfx.globalNum >> 8) | (rd.rfx.globalNum << 8);
     }
 
-    ptr += fitHeader.headerSize;
+    // Architecture, message number and field list make up the layout
+    size_t start = offsetof(RecordFixed, arch);
+    string layout((const char *)ptr + start, sizeof(rd.rfx) - start + rd.rfx.fieldsNum * sizeof(RecordField));
 
-    // FIT data CRC
-    for (int i = 0; i < fitHeader.dataSize; i++)
+    pthread_mutex_lock(&planCacheMutex);
+    unordered_map<string, DecodePlan>::iterator it = planCache.find(layout);
+    if (it != planCache.end())
+    {
+        rd.plan = &it->second;
+    }
+    else if (planCache.size() < planCacheSize)
+    {
+        DecodePlan &plan = planCache[layout];
+        compilePlan(rd.rfx, fields, plan);
+        rd.plan = &plan;
+    }
+    else
     {
-        crc = CRC_byte(crc, *(ptr+i));
+        compilePlan(rd.rfx, fields, rd.ownPlan);
+        rd.plan = &rd.ownPlan;
     }
+    pthread_mutex_unlock(&planCacheMutex);
 
-    if (memcmp(fitHeader.signature, ".FIT", sizeof(fitHeader.signature)))
+    rd.length = rd.plan->length;
+    rd.defined = true;
+}
+
+void FIT::compilePlan(const RecordFixed &rfx, const RecordField *fields, DecodePlan &plan)
+{
+    plan.globalNum = rfx.globalNum;
+    plan.length = 0;
+    plan.ops.clear();
+    plan.byteOrder.clear();
+
+    // Where the timestamp of this message goes, also when it comes from a
+    // compressed timestamp header
+    plan.timeColumn = ColumnTimeStamp;
+    for (size_t t=0; t<sizeof(planTargets)/sizeof(planTargets[0]); t++)
     {
-        logStream << "FIT signature not found";
-        logFlush();
-        return false;
+        if (planTargets[t].globalNum == rfx.globalNum && planTargets[t].definitionNum == timeStampField &&
+            planTargets[t].column != ColumnLog)
+        {
+            plan.timeColumn = planTargets[t].column;
+        }
     }
 
-    uint16_t fitCRC = *(uint16_t *)(ptr+fitHeader.dataSize);
-    if (crc != fitCRC)
+    for (int i=0; i<rfx.fieldsNum; i++)
     {
-        logStream << hex << uppercase << setw(4) << setfill('0');
-        logStream << "Invalid FIT CRC (" << crc << "!=" << fitCRC << ")";
-        logFlush();
+        const RecordField &rf = fields[i];
 
-        return false;
-    }
+        for (size_t t=0; t<sizeof(planTargets)/sizeof(planTargets[0]); t++)
+        {
+            const PlanTarget &target = planTargets[t];
+            if (target.globalNum != rfx.globalNum || target.definitionNum != rf.definitionNum)
+            {
+                continue;
+            }
 
-    logStream << "FIT Protocol Version " << dec << (unsigned)fitHeader.protocolVersion;
-    logFlush();
+            // Fields narrower than the value they should hold are not read
+            if (rf.size >= converterWidth[target.converter])
+            {
+                DecodeOp op;
+                op.offset = plan.length;
+                op.width = rf.size;
+                op.column = target.column;
+                op.converter = target.converter;
+                op.definitionNum = rf.definitionNum;
+                op.baseType = rf.baseType;
+                plan.ops.push_back(op);
+            }
+            break;
+        }
 
-    logStream << "FIT Profile Version " << fitHeader.profileVersion;
-    logFlush();
+        // Every full timestamp is the base for the compressed ones after it
+        if (rf.definitionNum == timeStampField && rf.size >= sizeof(uint32_t) &&
+            (plan.ops.empty() || plan.ops.back().offset != plan.length || plan.ops.back().column == ColumnLog))
+        {
+            DecodeOp op;
+            op.offset = plan.length;
+            op.width = rf.size;
+            op.column = ColumnTimeStamp;
+            op.converter = ConvertUInt32;
+            op.definitionNum = rf.definitionNum;
+            op.baseType = rf.baseType;
+            plan.ops.push_back(op);
+        }
 
-    logStream << "FIT Data size " << fitHeader.dataSize << " bytes";
-    logFlush();
-   
-    map<uint8_t, RecordDef> recDefMap;
+        // Records in the other byte order are converted as a whole before
+        // the ops run, so these see host order only
+        BaseType bt;
+        bt.byte = rf.baseType;
+        size_t elementSize = 1;
+        if (bt.bits.endianAbility && bt.bits.baseTypeNum < sizeof(baseTypeSize))
+        {
+            elementSize = baseTypeSize[bt.bits.baseTypeNum];
+        }
+        plan.byteOrder.addField(rf.size, (rfx.arch != hostArchitecture) ? elementSize : 1);
+
+        plan.length += rf.size;
+    }
+
+    plan.byteOrder.finish();
+}
+
+// What a data message has decoded so far
+struct RecordState
+{
+    uint32_t fileCreationTime;
+    int8_t fileType;
+    uint32_t time;
+    TrackPoint *point; // looked up once per record and timestamp
+};
 
-    for (int bytes = fitHeader.dataSize; bytes > 0;)
+static TrackPoint &trackPoint(GPX &gpx, RecordState &state)
+{
+    if (!state.point)
     {
-        RecordHeader rh;
-        memcpy(&rh, ptr, sizeof(rh));
-        ptr += sizeof(rh);
-        bytes -= sizeof(rh);
+        state.point = &gpx.tracks.back().trackSegs.back().trackPoints[state.time];
+    }
+
+    return *state.point;
+}
 
-        if (!rh.normalHeader.headerType)
+static void storeColumn(uint8_t column, uint32_t value, const uint8_t *field, uint8_t width, RecordState &state, uint32_t &timeStamp, GPX &gpx)
+{
+    switch (column)
+    {
+        case ColumnFileType: state.fileType = value; break;
+        case ColumnFileCreationTime: state.fileCreationTime = value; break;
+        case ColumnTimeStamp: timeStamp = value; break;
+        case ColumnPointTime:
         {
-            // Normal Header
-            if (rh.normalHeader.messageType)
-            {
-                // Definition Message
-                RecordDef rd;
+            timeStamp = state.time = value;
+            state.point = NULL;
+            trackPoint(gpx, state).time = value;
+            break;
+        }
+        case ColumnPointLatitude: trackPoint(gpx, state).latitude = value; break;
+        case ColumnPointLongitude: trackPoint(gpx, state).longitude = value; break;
+        case ColumnPointAltitude: trackPoint(gpx, state).altitude = value; break;
+        case ColumnPointHeartRate: trackPoint(gpx, state).heartRate = value; break;
+        case ColumnPointCadence: trackPoint(gpx, state).cadence = value; break;
+        case ColumnWayPointTime: timeStamp = gpx.wayPoints.back().time = value; break;
+        case ColumnWayPointName: gpx.wayPoints.back().name = GarminConvert::gString(field, min(width, (uint8_t)16)); break;
+        case ColumnWayPointLatitude: gpx.wayPoints.back().latitude = value; break;
+        case ColumnWayPointLongitude: gpx.wayPoints.back().longitude = value; break;
+        case ColumnWayPointAltitude: gpx.wayPoints.back().altitude = value; break;
+        case ColumnCourseName:
+        {
+            gpx.tracks.back().name = string("Course_") + GarminConvert::gString(field, min(width, (uint8_t)16));
+            break;
+        }
+    }
+}
 
-                RecordFixed rfx;
-                memcpy(&rfx, ptr, sizeof(rfx));
-                ptr += sizeof(rfx);
-                bytes -= sizeof(rfx);
+bool FIT::decodeData(const uint8_t *ptr, const DecodePlan &plan, GPX &gpx, uint32_t &timeStamp, bool compressedTime)
+{
+    //logStream << "Local Message \"" << messageTypeMap[plan.globalNum] << "\"(" << plan.globalNum << "):";
+    //logFlush();
 
-                rd.rfx = rfx;
+    if (plan.globalNum == 29) // WayPoint
+    {
+        gpx.newWayPoint();
+    }
 
-                for (int i=0; i<rfx.fieldsNum; i++)
-                {
-                    RecordField rf;
-                    memcpy(&rf, ptr, sizeof(rf));
-                    ptr += sizeof(rf);
-                    bytes -= sizeof(rf);
+    RecordState state = { 0, INT8_MAX, 0, NULL };
+
+    // A compressed timestamp header stands in for the timestamp field
+    if (compressedTime)
+    {
+        storeColumn(plan.timeColumn, timeStamp, NULL, 0, state, timeStamp, gpx);
+    }
+
+    for (size_t i=0; i<plan.ops.size(); i++)
+    {
+        const DecodeOp &op = plan.ops[i];
+        const uint8_t *field = ptr + op.offset;
+
+        uint32_t value = 0;
+        switch (op.converter)
+        {
+            case ConvertInt8: value = load<int8_t>(field); break;
+            case ConvertUInt8: value = load<uint8_t>(field); break;
+            case ConvertUInt16: value = load<uint16_t>(field); break;
+            case ConvertInt32: value = load<int32_t>(field); break;
+            case ConvertUInt32: value = load<uint32_t>(field); break;
+        }
 
-                    rd.rf.push_back(rf);
+        if (op.column == ColumnLog)
+        {
+            BaseType bt;
+            bt.byte = op.baseType;
+            logStream << messageFieldNameMap[plan.globalNum][op.definitionNum]
+                      << getDataString(field, op.width, bt.bits.baseTypeNum, plan.globalNum, op.definitionNum);
+            logFlush();
+        }
+        else
+        {
+            storeColumn(op.column, value, field, op.width, state, timeStamp, gpx);
+        }
+    }
+
+    switch(plan.globalNum)
+    {
+        case 0: // File Id
+        {
+            switch (state.fileType)
+            {
+                case 4: // Activity
+                {
+                    gpx.newTrack(string("Track_") + GarminConvert::localTime(state.fileCreationTime));
+                    break;
+                }
+                case 6: // Course
+                {
+                    gpx.newTrack(string("Course_") + GarminConvert::localTime(state.fileCreationTime));
+                    break;
                 }
+            }
+            break;
+        }
+        case 19: // Lap
+        {
+            gpx.newTrackSeg();
+            break;
+        }
+    }
 
-                recDefMap[rh.normalHeader.localMessageType] = rd;
+    return true;
+}
+
+FITDecoder::FITDecoder(FIT &fit, GPX &gpx) :
+    fit(fit),
+    gpx(gpx),
+    state(StateHeader),
+    dataRemaining(0),
+    crc(0),
+    consumed(0),
+    decoded(0),
+    timeStamp(0)
+{
+}
+
+bool FITDecoder::feed(const uint8_t *data, size_t len)
+{
+    while (len > 0 && state != StateError)
+    {
+        // Data past a CRC starts a chained FIT file with its own definitions
+        if (state == StateDone)
+        {
+            state = StateHeader;
+            timeStamp = 0;
+            for (unsigned i=0; i<localMessageTypes; i++)
+            {
+                recDefs[i] = RecordDef();
             }
-            else
+        }
+
+        // Complete units are decoded straight from the input
+        if (carry.empty())
+        {
+            size_t length = unitLength(data, len);
+            if (length > 0 && length <= len)
             {
-                // Data Message
-                map<uint8_t, RecordDef>::iterator it=recDefMap.find(rh.normalHeader.localMessageType);
-                if (it != recDefMap.end())
-                {
-                    RecordDef rd = recDefMap[rh.normalHeader.localMessageType];
-                    //logStream << "Local Message \"" << messageTypeMap[rd.rfx.globalNum] << "\"(" << rd.rfx.globalNum << "):";
-                    //logFlush();
-                    
-                    switch(rd.rfx.globalNum)
-                    {
-                        case 29: // WayPoint
-                        {
-                            gpx.newWayPoint();
-                            break;
-                        }
-                    }
+                process(data, length);
+                data += length;
+                len -= length;
+                continue;
+            }
+        }
 
-                    uint32_t fileCreationTime;
-                    int8_t fileType=INT8_MAX;
+        if (state == StateError)
+        {
+            break;
+        }
 
-                    uint32_t time;
+        // A unit split across chunks is collected in the carry buffer. Until
+        // its length is known only the bytes needed to tell are taken.
+        size_t length = carry.empty() ? 0 : unitLength(&carry.front(), carry.size());
+        size_t take = (length > carry.size()) ? min(len, length - carry.size()) : 1;
+        carry.insert(carry.end(), data, data + take);
+        data += take;
+        len -= take;
 
-                    for (int i=0; i<rd.rfx.fieldsNum; i++)
-                    {
-                        RecordField &rf = rd.rf[i];
+        length = unitLength(&carry.front(), carry.size());
+        if (length > 0 && carry.size() >= length)
+        {
+            process(&carry.front(), length);
+            carry.clear();
+        }
+    }
 
-                        BaseType bt;
-                        bt.byte = rf.baseType;
+    return state != StateError;
+}
 
-                        //logStream << rd.rfx.globalNum << "." << (unsigned)rf.definitionNum << ": " << messageFieldNameMap[rd.rfx.globalNum][rf.definitionNum] << " (" << dataTypeMap[bt.bits.baseTypeNum] << ") " << getDataString(ptr, rf.size, bt.bits.baseTypeNum, rd.rfx.globalNum, rf.definitionNum);
-			//logFlush();
+bool FITDecoder::finish()
+{
+    if (state == StateDone)
+    {
+        return true;
+    }
 
-			if(rd.rfx.globalNum == 18 && (rf.definitionNum == 253 || rf.definitionNum == 9)) {
-			  logStream << messageFieldNameMap[rd.rfx.globalNum][rf.definitionNum] 
-				    << getDataString(ptr, rf.size, bt.bits.baseTypeNum, rd.rfx.globalNum, rf.definitionNum);
-			  logFlush();
-			}
+    if (state != StateError)
+    {
+        logStream << "FIT data ended " << dec << dataRemaining << " bytes before its CRC";
+        logFlush();
+    }
 
-                        switch(rd.rfx.globalNum)
-                        {
-                            case 0: // File Id
-                            {
-                                switch(rf.definitionNum)
-                                {
-                                    case 0: // Type
-                                    {
-                                        fileType = *(int8_t *)ptr;
-                                        break;
-                                    }
-                                    case 4: // Creation Time
-                                    {
-                                        fileCreationTime = *(uint32_t*)ptr;
-                                        break;
-                                    }
-                                }
-                                break;
-                            }
-                            case 20: // Record
-                            {
-                                switch(rf.definitionNum)
-                                {
-                                    case 253: // Timestamp
-                                    {
-                                        time = *(uint32_t*)ptr;
-                                        gpx.tracks.back().trackSegs.back().trackPoints[time].time = time;
-                                        break;
-                                    }
-                                    case 0: // Latitude
-                                    {
-                                        int32_t latitude = *(int32_t*)ptr;
-                                        gpx.tracks.back().trackSegs.back().trackPoints[time].latitude = latitude;
-                                        break;
-                                    }
-                                    case 1: // Longitude
-                                    {
-                                        uint32_t longitude = *(int32_t*)ptr;
-                                        gpx.tracks.back().trackSegs.back().trackPoints[time].longitude = longitude;
-                                        break;
-                                    }
-                                    case 2: // Altitude
-                                    {
-                                        uint16_t altitude = *(uint16_t*)ptr;
-                                        gpx.tracks.back().trackSegs.back().trackPoints[time].altitude = altitude;
-                                        break;
-                                    }
-                                    case 3: // Heart Rate
-                                    {
-                                        uint8_t heartRate = *(uint8_t*)ptr;
-                                        gpx.tracks.back().trackSegs.back().trackPoints[time].heartRate = heartRate;
-                                        break;
-                                    }
-                                    case 4: // Cadence
-                                    {
-                                        uint8_t cadence = *(uint8_t*)ptr;
-                                        gpx.tracks.back().trackSegs.back().trackPoints[time].cadence = cadence;
-                                        break;
-                                    }
-                                }
-                                break;
-                            }
-                            case 29: // WayPoint
-                            {
-                                switch(rf.definitionNum)
-                                {
-                                    case 253: // Timestamp
-                                    {
-                                        time = *(uint32_t*)ptr;
-                                        gpx.wayPoints.back().time = time;
-                                        break;
-                                    }
-                                    case 0: // Name
-                                    {
-                                        string name = GarminConvert::gString(ptr, 16);
-                                        gpx.wayPoints.back().name = name;
-                                        break;
-                                    }
-                                    case 1: // Latitude
-                                    {
-                                        int32_t latitude = *(int32_t*)ptr;
-                                        gpx.wayPoints.back().latitude = latitude;
-                                        break;
-                                    }
-                                    case 2: // Longitude
-                                    {
-                                        int32_t longitude = *(int32_t*)ptr;
-                                        gpx.wayPoints.back().longitude = longitude;
-                                        break;
-                                    }
-                                    case 3: // Symbol
-                                    {
-                                        break;
-                                    }
-                                    case 4: // Altitude
-                                    {
-                                        uint16_t altitude = *(uint16_t*)ptr;
-                                        gpx.wayPoints.back().altitude = altitude;
-                                        break;
-                                    }
-                                }
-                                break;
-                            }
-                            case 31: // Course
-                            {
-                                switch(rf.definitionNum)
-                                {
-                                    case 5: // Name
-                                    {
-                                        string name("Course_");
-                                        name += GarminConvert::gString(ptr, 16);
-                                        gpx.tracks.back().name = name;
-                                        break;
-                                    }
-                                }
-                                break;
-                            }
-                        }
+    return false;
+}
 
-                        ptr += rf.size;
-                        bytes -= rf.size;
-                    }
+size_t FITDecoder::unitLength(const uint8_t *ptr, size_t len)
+{
+    switch (state)
+    {
+        case StateHeader:
+        {
+            if (ptr[0] < offsetof(FITHeader, headerCRC))
+            {
+                logStream << "FIT signature not found";
+                logFlush();
+                state = StateError;
+                return 0;
+            }
+            return ptr[0];
+        }
+        case StateCRC:
+        {
+            return sizeof(uint16_t);
+        }
+        case StateRecords:
+        {
+            break;
+        }
+        default:
+        {
+            return 0;
+        }
+    }
 
-                    switch(rd.rfx.globalNum)
-                    {
-                        case 0: // File Id
-                        {
-                            switch (fileType)
-                            {
-                                case 4: // Activity
-                                {
-                                    gpx.newTrack(string("Track_") + GarminConvert::localTime(fileCreationTime));
-                                    break;
-                                }
-                                case 6: // Course
-                                {
-                                    gpx.newTrack(string("Course_") + GarminConvert::localTime(fileCreationTime));
-                                    break;
-                                }
-                            }
-                            break;
-                        }
-                        case 19: // Lap
-                        {
-                            gpx.newTrackSeg();
-                            break;
-                        }
-                    }
-                }
-                else
+    RecordHeader rh;
+    memcpy(&rh, ptr, sizeof(rh));
+
+    size_t length = 0;
+    if (!rh.normalHeader.headerType && rh.normalHeader.messageType)
+    {
+        // Definition Message, its length follows from the field count
+        if (len < sizeof(rh) + sizeof(RecordFixed))
+        {
+            return 0;
+        }
+
+        RecordFixed rfx;
+        memcpy(&rfx, ptr + sizeof(rh), sizeof(rfx));
+        length = sizeof(rh) + sizeof(rfx) + rfx.fieldsNum * sizeof(RecordField);
+    }
+    else
+    {
+        uint8_t localMessageType = rh.normalHeader.headerType ? rh.ctsHeader.localMessageType : rh.normalHeader.localMessageType;
+        if (!recDefs[localMessageType].defined)
+        {
+            logStream << "Undefined Local Message Type: " << (unsigned)localMessageType;
+            logFlush();
+            state = StateError;
+            return 0;
+        }
+
+        length = sizeof(rh) + recDefs[localMessageType].length;
+    }
+
+    if (length > dataRemaining)
+    {
+        logStream << "FIT record of " << dec << length << " bytes overruns the data size";
+        logFlush();
+        state = StateError;
+        return 0;
+    }
+
+    return length;
+}
+
+const uint8_t *FITDecoder::hostOrder(const uint8_t *payload, const DecodePlan &plan)
+{
+    if (!plan.byteOrder.swaps())
+    {
+        return payload;
+    }
+
+    // The buffer only grows, records of the other byte order cost no allocation
+    if (swapped.size() < plan.length)
+    {
+        swapped.resize(plan.length);
+    }
+    plan.byteOrder.apply(payload, &swapped.front());
+
+    return &swapped.front();
+}
+
+void FITDecoder::process(const uint8_t *ptr, size_t length)
+{
+    consumed += length;
+
+    switch (state)
+    {
+        case StateHeader:
+        {
+            FITHeader fitHeader;
+            memset(&fitHeader, 0, sizeof(fitHeader));
+            memcpy(&fitHeader, ptr, min(length, sizeof(fitHeader)));
+
+            logStream << "Parsing FIT file";
+            logFlush();
+
+            if (length < offsetof(FITHeader, headerCRC) || memcmp(fitHeader.signature, ".FIT", sizeof(fitHeader.signature)))
+            {
+                logStream << "FIT signature not found";
+                logFlush();
+                state = StateError;
+                return;
+            }
+
+            logStream << "FIT Protocol Version " << dec << (unsigned)fitHeader.protocolVersion;
+            logFlush();
+
+            logStream << "FIT Profile Version " << fitHeader.profileVersion;
+            logFlush();
+
+            logStream << "FIT Data size " << fitHeader.dataSize << " bytes";
+            logFlush();
+
+            crc = CRC16::update(0, ptr, length);
+            dataRemaining = fitHeader.dataSize;
+            state = dataRemaining ? StateRecords : StateCRC;
+            break;
+        }
+
+        case StateRecords:
+        {
+            crc = CRC16::update(crc, ptr, length);
+            dataRemaining -= length;
+
+            RecordHeader rh;
+            memcpy(&rh, ptr, sizeof(rh));
+
+            if (!rh.normalHeader.headerType && rh.normalHeader.messageType)
+            {
+                fit.decodeDefinition(ptr + sizeof(rh), recDefs[rh.normalHeader.localMessageType]);
+            }
+            else
+            {
+                bool compressedTime = rh.normalHeader.headerType;
+                if (compressedTime)
                 {
-                    logStream << "Undefined Local Message Type: " << (unsigned)rh.normalHeader.localMessageType;
-                    logFlush();
+                    // Compressed Timestamp Header: the low five bits of the
+                    // time since the last full timestamp, rolling over every 32 s
+                    uint32_t offset = rh.ctsHeader.timeOffset;
+                    uint32_t base = timeStamp & ~0x1FU;
+                    timeStamp = base + offset + ((offset < (timeStamp & 0x1F)) ? 0x20 : 0);
+                }
 
-                    return false;
+                uint8_t localMessageType = compressedTime ? rh.ctsHeader.localMessageType : rh.normalHeader.localMessageType;
+                const DecodePlan &plan = *recDefs[localMessageType].plan;
+                if (!fit.decodeData(hostOrder(ptr + sizeof(rh), plan), plan, gpx, timeStamp, compressedTime))
+                {
+                    state = StateError;
+                    return;
                 }
             }
+
+            if (dataRemaining == 0)
+            {
+                state = StateCRC;
+            }
+            break;
         }
-        else
+
+        case StateCRC:
         {
-            // Compressed Timestamp Header
-            logStream << "Compressed Timestamp Header:" << endl;
-            logStream << "  Local Message Type " << (unsigned)rh.ctsHeader.localMessageType << endl;
-            logStream << "  Time Offset " << (unsigned)rh.ctsHeader.timeOffset;
-            logFlush();
+            uint16_t fitCRC = ptr[0] | (ptr[1] << 8);
+            if (crc != fitCRC)
+            {
+                logStream << hex << uppercase << setw(4) << setfill('0');
+                logStream << "Invalid FIT CRC (" << crc << "!=" << fitCRC << ")";
+                logFlush();
+                state = StateError;
+                return;
+            }
+
+            decoded = consumed;
+            state = StateDone;
+            break;
         }
-    }
 
-    return true;
+        default:
+        {
+            break;
+        }
+    }
 }
 
 bool FIT::parseZeroFile(vector<uint8_t> &data, ZeroFileContent &zeroFileContent)
@@ -1137,6 +1406,7 @@ bool FIT::parseZeroFile(vector<uint8_t> &data, ZeroFileContent &zeroFileContent)
 
     memcpy(&directoryHeader, &data.front(), sizeof(directoryHeader));
     data.erase(data.begin(), data.begin()+sizeof(directoryHeader));
+    zeroFileContent.header = directoryHeader;
     
     logStream << "Directory version: " << hex << setw(2) << (unsigned)directoryHeader.version;
     logFlush();
@@ -1176,6 +1446,8 @@ bool FIT::parseZeroFile(vector<uint8_t> &data, ZeroFileContent &zeroFileContent)
         if (zfRecord.generalFileFlags.crypto) logStream << "[C]";
         logFlush();
 
+        zeroFileContent.records[zfRecord.index] = zfRecord;
+
         switch(zfRecord.recordType)
         {
             case 4: // Activity
@@ -63,7 +63,8 @@ string GarminConvert::gmTime(uint32_t time)
     time_t t = time;
     t += GARMIN_EPOCH; // Garmin epoch offset
     char tbuf[256];
-    strftime(tbuf, sizeof(tbuf), "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+    struct tm tm;
+    strftime(tbuf, sizeof(tbuf), "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&t, &tm));
 
     return tbuf;
 }
@@ -73,7 +74,8 @@ string GarminConvert::localTime(uint32_t time)
     time_t t = time;
     t += GARMIN_EPOCH; // Garmin epoch offset
     char tbuf[256];
-    strftime(tbuf, sizeof(tbuf), "%d-%m-%Y %H:%M:%S", localtime(&t));
+    struct tm tm;
+    strftime(tbuf, sizeof(tbuf), "%d-%m-%Y %H:%M:%S", localtime_r(&t, &tm));
 
     return tbuf;
 }
@@ -95,7 +97,7 @@ string GarminConvert::gTime(uint32_t time)
     return sstr.str();
 }
 
-string GarminConvert::gString(uint8_t *str, int maxSize)
+string GarminConvert::gString(const uint8_t *str, int maxSize)
 {
     string rv;
     for(int i=0; i<maxSize; i++)
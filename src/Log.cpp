@@ -21,26 +21,34 @@
 #include "Log.h"
 
 #include <iostream>
+#include <pthread.h>
 
-ostringstream logStream;
-ostringstream parseThreadLogStream;
+thread_local ostringstream logStream;
+thread_local ostringstream parseThreadLogStream;
+
+static pthread_mutex_t outputMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void output(ostringstream &stream)
+{
+    pthread_mutex_lock(&outputMutex);
+    cout << stream.str();
+    pthread_mutex_unlock(&outputMutex);
+    stream.str(string());
+}
 
 void logFlush()
 {
     logStream << endl;
-    cout << logStream.str();
-    logStream.str(string());
+    output(logStream);
 }
 
 void logPush()
 {
-    cout << logStream.str();
-    logStream.str(string());
+    output(logStream);
 }
 
 void parseThreadLogFlush()
 {
     parseThreadLogStream << endl;
-    cout << parseThreadLogStream.str();
-    parseThreadLogStream.str(string());
+    output(parseThreadLogStream);
 }
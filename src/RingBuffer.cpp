@@ -0,0 +1,70 @@
+/***************************************************************************
+ *   Copyright (C) 2010-2012 by Oleg Khudyakov                             *
+ *   prcoder@gmail.com                                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "RingBuffer.h"
+
+RingBuffer::RingBuffer(size_t capacity) :
+    buffer(new uint8_t[capacity]),
+    size(capacity),
+    head(0),
+    tail(0)
+{
+}
+
+RingBuffer::~RingBuffer()
+{
+    delete[] buffer;
+}
+
+size_t RingBuffer::writable(uint8_t *&ptr)
+{
+    size_t h = head;
+    size_t t = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+
+    size_t used = h - t;
+    size_t offset = h % size;
+    size_t contiguous = size - offset;
+
+    ptr = buffer + offset;
+    return (size - used < contiguous) ? size - used : contiguous;
+}
+
+void RingBuffer::commit(size_t len)
+{
+    __atomic_store_n(&head, head + len, __ATOMIC_RELEASE);
+}
+
+size_t RingBuffer::readable(const uint8_t *&ptr)
+{
+    size_t t = tail;
+    size_t h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+
+    size_t used = h - t;
+    size_t offset = t % size;
+    size_t contiguous = size - offset;
+
+    ptr = buffer + offset;
+    return (used < contiguous) ? used : contiguous;
+}
+
+void RingBuffer::consume(size_t len)
+{
+    __atomic_store_n(&tail, tail + len, __ATOMIC_RELEASE);
+}
@@ -21,19 +21,27 @@
 #include "Log.h"
 #include <fcntl.h>
 #include <string.h>
-#include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <time.h>
 #include <iostream>
 #include <iomanip>
 #include <errno.h>
 #include <unistd.h>
 
-SerialIO::SerialIO() : fd(-1), timeout(60)
+SerialIO::SerialIO() : fd(-1), timeout(60), reactor(NULL), txOffset(0), txWatched(false), rxPaused(false)
 {
+    pthread_mutex_init(&txMutex, NULL);
+    pthread_mutex_init(&watchMutex, NULL);
 }
 
 SerialIO::~SerialIO()
 {
     close();
+    pthread_mutex_destroy(&txMutex);
+    pthread_mutex_destroy(&watchMutex);
 }
 
 bool SerialIO::open(string deviceName, speed_t speed)
@@ -106,14 +114,32 @@ bool SerialIO::open(string deviceName, speed_t speed)
 
 void SerialIO::close()
 {
+    if (fd == -1)
+    {
+        return;
+    }
+
+    drain();
+
     ::tcflush(fd, TCIOFLUSH);
     ::close(fd);
+    fd = -1;
+
+    pthread_mutex_lock(&txMutex);
+    txQueue.clear();
+    txOffset = 0;
+    pthread_mutex_unlock(&txMutex);
 }
 
 bool SerialIO::receiveBuffer(vector<uint8_t> &buffer)
 {
-    size_t len = 1024;
+    size_t len = pendingBytes();
     buffer.resize(len);
+    if (len == 0)
+    {
+        return true;
+    }
+
     bool rv = receiveBuffer(&buffer.front(), len);
     if (!rv)
     {
@@ -126,18 +152,108 @@ bool SerialIO::receiveBuffer(vector<uint8_t> &buffer)
     return true;
 }
 
+bool SerialIO::receiveBuffer(RingBuffer &ring)
+{
+    // Two passes at most: up to the end of the ring, then after wrap-around
+    for (int pass = 0; pass < 2; pass++)
+    {
+        size_t pending = pendingBytes();
+        if (pending == 0 && pass > 0)
+        {
+            break;
+        }
+
+        uint8_t *ptr;
+        size_t len = ring.writable(ptr);
+        if (len == 0)
+        {
+            // Ring is full: stop reading until the consumer frees space. It
+            // may have done so since the check, then carry on right away.
+            pthread_mutex_lock(&watchMutex);
+            rxPaused = true;
+            watchEvents();
+            pthread_mutex_unlock(&watchMutex);
+            if (ring.writable(ptr) > 0)
+            {
+                resumeReceive();
+            }
+            break;
+        }
+
+        if (pending > 0 && pending < len)
+        {
+            len = pending;
+        }
+
+        if (!receiveBuffer(ptr, len))
+        {
+            return false;
+        }
+
+        ring.commit(len);
+    }
+
+    return true;
+}
+
+bool SerialIO::receiveBuffer(uint8_t *buffer, size_t &len)
+{
+    ssize_t bytesRead = ::read(fd, buffer, len);
+    if (bytesRead == -1)
+    {
+        if (errno == EAGAIN || errno == EINTR)
+        {
+            len = 0;
+            return true;
+        }
+
+        logStream << "Error reading data from port: " << strerror(errno) << "(" << errno << ")";
+        logFlush();
+        return false;
+    }
+
+    len = bytesRead;
+
+    return true;
+}
+
+size_t SerialIO::pendingBytes()
+{
+    int pending = 0;
+    if (::ioctl(fd, FIONREAD, &pending) == -1 || pending < 0)
+    {
+        return 0;
+    }
+
+    return pending;
+}
 
 bool SerialIO::sendBuffer(vector<uint8_t> &buffer)
 {
-    ::tcflush(fd, TCIFLUSH);
-    
-    size_t size = buffer.size();
+    if (buffer.empty())
+    {
+        return true;
+    }
 
-    int bytes = ::write(fd, &buffer.front(), size);
-    if (bytes != size)
+    pthread_mutex_lock(&txMutex);
+    txQueue.push_back(buffer);
+    bool rv = writeQueue();
+
+    // Without a reactor to finish the job the caller waits for the port
+    while (rv && !reactor && !txQueue.empty())
+    {
+        waitWritable(100);
+        rv = writeQueue();
+    }
+    pthread_mutex_unlock(&txMutex);
+
+    return rv;
+}
+
+bool SerialIO::drain(int milliseconds)
+{
+    if (!flush(milliseconds))
     {
-        logStream << "Error writing data to the port: " << strerror(errno) << "(" << errno << ")";
-        logFlush();
         return false;
     }
 
@@ -146,53 +262,308 @@ bool SerialIO::sendBuffer(vector<uint8_t> &buffer)
     return true;
 }
 
-bool SerialIO::receiveBuffer(uint8_t *buffer, size_t &len)
+bool SerialIO::flush(int milliseconds)
 {
-    fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(fd, &fds);
+    pthread_mutex_lock(&txMutex);
+    bool rv = writeQueue();
+    for (int waited = 0; rv && !txQueue.empty() && waited < milliseconds; waited += 10)
+    {
+        waitWritable(10);
+        rv = writeQueue();
+    }
+    bool drained = txQueue.empty();
+    pthread_mutex_unlock(&txMutex);
+
+    if (!drained)
+    {
+        logStream << "Timeout writing data to the port";
+        logFlush();
+        return false;
+    }
 
-    struct timeval tv;
-    tv.tv_sec = timeout;
-    tv.tv_usec = 0;
+    return rv;
+}
 
-    int rv = ::select(fd+1, &fds, NULL, NULL, &tv);
-    if (rv < 0)
+void SerialIO::waitWritable(int milliseconds)
+{
+    // Called with txMutex held
+    pthread_mutex_unlock(&txMutex);
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    ::poll(&pfd, 1, milliseconds);
+    pthread_mutex_lock(&txMutex);
+}
+
+bool SerialIO::writeQueue()
+{
+    // Called with txMutex held
+    const int maxFrames = 16;
+    while (!txQueue.empty())
+    {
+        struct iovec iov[maxFrames];
+        int frames = 0;
+        for (deque<vector<uint8_t> >::iterator it = txQueue.begin(); it != txQueue.end() && frames < maxFrames; ++it, ++frames)
+        {
+            size_t offset = frames ? 0 : txOffset;
+            iov[frames].iov_base = &it->front() + offset;
+            iov[frames].iov_len = it->size() - offset;
+        }
+
+        ssize_t bytes = ::writev(fd, iov, frames);
+        if (bytes == -1)
+        {
+            if (errno == EAGAIN || errno == EINTR)
+            {
+                break;
+            }
+
+            logStream << "Error writing data to the port: " << strerror(errno) << "(" << errno << ")";
+            logFlush();
+            return false;
+        }
+
+        txOffset += bytes;
+        while (!txQueue.empty() && txOffset >= txQueue.front().size())
+        {
+            txOffset -= txQueue.front().size();
+            txQueue.pop_front();
+        }
+    }
+
+    watchWritable();
+
+    return true;
+}
+
+void SerialIO::resumeReceive()
+{
+    if (!rxPaused)
     {
-        logStream << "Error calling select(): " << strerror(errno) << "(" << errno << ")";
+        return;
+    }
+
+    pthread_mutex_lock(&watchMutex);
+    rxPaused = false;
+    watchEvents();
+    pthread_mutex_unlock(&watchMutex);
+}
+
+void SerialIO::watchWritable()
+{
+    // Called with txMutex held
+    bool watch = !txQueue.empty();
+    if (reactor && watch != txWatched)
+    {
+        pthread_mutex_lock(&watchMutex);
+        txWatched = watch;
+        watchEvents();
+        pthread_mutex_unlock(&watchMutex);
+    }
+}
+
+void SerialIO::watchEvents()
+{
+    // Called with watchMutex held
+    if (reactor)
+    {
+        reactor->watch(*this, !rxPaused, txWatched);
+    }
+}
+
+SerialReactor::SerialReactor() : epollFd(-1)
+{
+    pthread_mutex_init(&mutex, NULL);
+}
+
+SerialReactor::~SerialReactor()
+{
+    close();
+    pthread_mutex_destroy(&mutex);
+}
+
+bool SerialReactor::open()
+{
+    epollFd = ::epoll_create(1);
+    if (epollFd == -1)
+    {
+        logStream << "Error creating epoll descriptor: " << strerror(errno) << "(" << errno << ")";
         logFlush();
         return false;
     }
-    
-    if (rv == 0)
+
+    return true;
+}
+
+void SerialReactor::close()
+{
+    pthread_mutex_lock(&mutex);
+    while (!registrations.empty())
+    {
+        erase(registrations.begin()->first);
+    }
+    pthread_mutex_unlock(&mutex);
+
+    if (epollFd != -1)
+    {
+        ::close(epollFd);
+        epollFd = -1;
+    }
+}
+
+bool SerialReactor::add(SerialIO &sio, SerialListener *listener)
+{
+    Registration reg;
+    reg.sio = &sio;
+    reg.listener = listener;
+    reg.lastActivity = now();
+
+    pthread_mutex_lock(&mutex);
+    registrations[sio.fd] = reg;
+    pthread_mutex_unlock(&mutex);
+    sio.reactor = this;
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = sio.fd;
+    if (::epoll_ctl(epollFd, EPOLL_CTL_ADD, sio.fd, &event) == -1)
+    {
+        logStream << "Error adding serial port to epoll: " << strerror(errno) << "(" << errno << ")";
+        logFlush();
+
+        sio.reactor = NULL;
+        pthread_mutex_lock(&mutex);
+        registrations.erase(sio.fd);
+        pthread_mutex_unlock(&mutex);
+        return false;
+    }
+
+    return true;
+}
+
+void SerialReactor::remove(SerialIO &sio)
+{
+    pthread_mutex_lock(&mutex);
+    erase(sio.fd);
+    pthread_mutex_unlock(&mutex);
+}
+
+void SerialReactor::watch(SerialIO &sio, bool readable, bool writable)
+{
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = (readable ? uint32_t(EPOLLIN) : 0U) | (writable ? uint32_t(EPOLLOUT) : 0U);
+    event.data.fd = sio.fd;
+    ::epoll_ctl(epollFd, EPOLL_CTL_MOD, sio.fd, &event);
+}
+
+void SerialReactor::erase(int fd)
+{
+    map<int, Registration>::iterator it = registrations.find(fd);
+    if (it != registrations.end())
+    {
+        it->second.sio->reactor = NULL;
+        it->second.sio->txWatched = false;
+        it->second.sio->rxPaused = false;
+        registrations.erase(it);
+    }
+    ::epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+void SerialReactor::drop(int fd)
+{
+    map<int, Registration>::iterator it = registrations.find(fd);
+    if (it == registrations.end())
     {
-        logStream << "Timeout waiting data from port";
+        return;
+    }
+
+    Registration reg = it->second;
+    erase(fd);
+    reg.listener->serialClosed(*reg.sio);
+}
+
+uint64_t SerialReactor::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+bool SerialReactor::run(int timeout)
+{
+    const int maxEvents = 16;
+    struct epoll_event events[maxEvents];
+
+    int rv = ::epoll_wait(epollFd, events, maxEvents, timeout);
+    if (rv < 0)
+    {
+        if (errno == EINTR)
+        {
+            return true;
+        }
+
+        logStream << "Error calling epoll_wait(): " << strerror(errno) << "(" << errno << ")";
         logFlush();
         return false;
     }
 
-    ssize_t bytesInBuffer = 0;
-    for(;;)
+    uint64_t time = now();
+
+    pthread_mutex_lock(&mutex);
+    for (int i = 0; i < rv; i++)
     {
-        ssize_t bytesToRead = len - bytesInBuffer;
-        ssize_t bytesRead = read(fd, buffer, bytesToRead);
-        if (bytesRead == -1)
+        map<int, Registration>::iterator it = registrations.find(events[i].data.fd);
+        if (it == registrations.end())
+        {
+            continue;
+        }
+
+        Registration &reg = it->second;
+        if (events[i].events & EPOLLOUT)
+        {
+            pthread_mutex_lock(&reg.sio->txMutex);
+            reg.sio->writeQueue();
+            pthread_mutex_unlock(&reg.sio->txMutex);
+        }
+
+        if (events[i].events & EPOLLIN)
         {
-            logStream << "Error reading data from port: " << strerror(errno) << "(" << errno << ")";
+            reg.lastActivity = time;
+            if (!reg.listener->serialDataReceived(*reg.sio))
+            {
+                drop(it->first);
+                continue;
+            }
+        }
+
+        if (events[i].events & (EPOLLERR | EPOLLHUP))
+        {
+            logStream << "Serial port closed by the device";
             logFlush();
-            return false;
+            drop(it->first);
         }
-        
-        bytesInBuffer += bytesRead;
-        buffer += bytesRead;
-        
-        if (bytesRead == 0)
+    }
+
+    map<int, Registration>::iterator it = registrations.begin();
+    while (it != registrations.end())
+    {
+        Registration &reg = (it++)->second;
+        if (time - reg.lastActivity < (uint64_t)reg.sio->timeout * 1000)
         {
-            len = bytesInBuffer;
-            //logFlush();
-            break;
+            continue;
+        }
+
+        reg.lastActivity = time;
+        if (!reg.listener->serialTimeout(*reg.sio))
+        {
+            drop(reg.sio->fd);
         }
     }
-            
+    pthread_mutex_unlock(&mutex);
+
     return true;
 }
@@ -19,12 +19,16 @@
  ***************************************************************************/
 
 #include "ANTPlus.h"
+#include "CRC16.h"
 #include "FIT.h"
 #include "GPX.h"
+#include "Catalog.h"
 #include "CommandLineOptions.h"
+#include "ExportPipeline.h"
 #include <iostream>
 #include <iomanip>
 #include <unistd.h>
+#include <string.h>
 #include <vector>
 #include <fstream>
 #include <iterator>
@@ -34,6 +38,15 @@
 
 #define HOSTSN 0x1
 
+#define EXPORT_QUEUE_SIZE 4
+#define EXPORT_WORKERS 2
+
+static CatalogEntry catalogEntry(uint32_t unitId, const ZeroFileRecord &record)
+{
+    CatalogEntry entry = { unitId, record.index, record.timeStamp, record.fileSize };
+    return entry;
+}
+
 int main(int argc, char *argv[])
 {
     const char* optString = "hplu";
@@ -43,19 +56,10 @@ int main(int argc, char *argv[])
     logFlush();
 
     // Check for already copied acitivies:
-    //    if (clOpt.isSet('u')) {    
-      ifstream is("activities.dat");
-      istream_iterator<int> start(is), end;
-      vector<int> numbers(start, end);
-      logStream << "Already downloaded " << numbers.size() << " activies:";
-      logFlush();
-
-      // print the numbers to stdout
-      logStream << hex;
-      copy(numbers.begin(), numbers.end(),ostream_iterator<double>(logStream, " "));
-      logStream << dec;
-      logFlush();
-      // }
+    Catalog catalog("catalog.dat");
+    catalog.load();
+    logStream << "Already downloaded " << catalog.size() << " activities";
+    logFlush();
 
     ANTPlus ant;
     if(!ant.init("/dev/ttyUSB0", B115200))
@@ -96,67 +100,22 @@ int main(int argc, char *argv[])
 
     if (clOpt.isSet('h'))
     {
-        uint8_t net = 0;
         uint8_t netKey[8] = { 0xB9, 0xA5, 0x21, 0xFB, 0xBD, 0x72, 0xC3, 0x45 }; // ANT+ Network Key (HRM)
-        
-        vector<uint8_t> networkKey(netKey, netKey+sizeof(netKey));
-        if (!ant.setNetworkKey(net, networkKey))
-        {
-            logStream << "Error setting network key";
-            logFlush();
-            ant.leave(channel);
-            return EXIT_FAILURE;
-        }
-        
-        if (!ant.assignChannel(channel, ReceiveChannel, net))
-        {
-            logStream << "Error assigning channel";
-            logFlush();
-            ant.leave(channel);
-            return EXIT_FAILURE;
-        }
-        
-        uint16_t period = 8070; // (HRM)
-        if (!ant.setChannelPeriod(channel, period))
-        {
-            logStream << "Error setting channel period";
-            logFlush();
-            ant.leave(channel);
-            return EXIT_FAILURE;
-        }
-
-        uint16_t timeout = 5; // timeout = N / 2.5s, 0x00 = immediate, 0xFF = unlimited (HRM)
-        if (!ant.setChannelSearchTimeout(channel, timeout))
-        {
-            logStream << "Error setting search timeout";
-            logFlush();
-            ant.leave(channel);
-            return EXIT_FAILURE;
-        }
-
-        uint8_t frequency = 57; // 2400 Mhz + 57 Mhz = 2457 Mhz (ANT+ HRM, Spd, Cad)
-        if (!ant.setChannelRFFreq(channel, frequency))
-        {
-            logStream << "Error setting radio frequency";
-            logFlush();
-            ant.leave(channel);
-            return EXIT_FAILURE;
-        }
-
-        uint16_t deviceNum = 0;
-        bool pairing = false;
-        uint8_t deviceType =  0x78;
-        uint8_t transmissionType = 0; // 0x05;
 
-        if (!ant.setChannelId(channel, deviceNum, pairing, deviceType, transmissionType))
-        {
-            logStream << "Error setting channel ID";
-            logFlush();
-            ant.leave(channel);
-            return EXIT_FAILURE;
-        }
-
-        if (!ant.openChannel(channel))
+        ANTChannelProfile profile;
+        profile.network = 0;
+        profile.networkKey.assign(netKey, netKey+sizeof(netKey));
+        profile.type = ReceiveChannel;
+        profile.period = 8070; // (HRM)
+        profile.searchTimeout = 5; // timeout = N / 2.5s, 0x00 = immediate, 0xFF = unlimited (HRM)
+        profile.frequency = 57; // 2400 Mhz + 57 Mhz = 2457 Mhz (ANT+ HRM, Spd, Cad)
+        profile.searchWaveform = 0;
+        profile.deviceNum = 0;
+        profile.pairing = false;
+        profile.deviceType = 0x78;
+        profile.transmissionType = 0; // 0x05;
+
+        if (!ant.openChannel(channel, profile))
         {
             logStream << "Error opening channel";
             logFlush();
@@ -172,74 +131,22 @@ int main(int argc, char *argv[])
         return EXIT_SUCCESS;
     }
     
-    uint8_t net = 0;
     uint8_t netKey[8] = { 0xA8, 0xA4, 0x23, 0xB9, 0xF5, 0x5E, 0x63, 0xC1 }; // ANTFS Network Key
-    vector<uint8_t> networkKey(netKey, netKey+sizeof(netKey));
-    if (!ant.setNetworkKey(net, networkKey))
-    {
-        logStream << "Error setting network key";
-        logFlush();
-        ant.leave(channel);
-        return EXIT_FAILURE;
-    }
-
-    if (!ant.assignChannel(channel, ReceiveChannel, net))
-    {
-        logStream << "Error assigning channel";
-        logFlush();
-        ant.leave(channel);
-        return EXIT_FAILURE;
-    }
-
-    uint16_t period = 4096; // period = 32768 / 8,00 Hz = 4096
-    if (!ant.setChannelPeriod(channel, period))
-    {
-        logStream << "Error setting channel period";
-        logFlush();
-        ant.leave(channel);
-        return EXIT_FAILURE;
-    }
 
-    uint16_t timeout = 0xFF; // timeout = N / 2.5s, 0x00 = immediate, 0xFF = unlimited
-    if (!ant.setChannelSearchTimeout(channel, timeout))
-    {
-        logStream << "Error setting search timeout";
-        logFlush();
-        ant.leave(channel);
-        return EXIT_FAILURE;
-    }
-
-    uint8_t frequency = 50; // 2400 Mhz + 50 Mhz = 2450 Mhz (ANTFS)
-    if (!ant.setChannelRFFreq(channel, frequency))
-    {
-        logStream << "Error setting radio frequency";
-        logFlush();
-        ant.leave(channel);
-        return EXIT_FAILURE;
-    }
-
-    uint16_t waveform = 83;
-    if (!ant.setSearchWaveform(channel, waveform))
-    {
-        logStream << "Error setting wave form";
-        logFlush();
-        ant.leave(channel);
-        return EXIT_FAILURE;
-    }
-
-    uint16_t deviceNum = 0;
-    bool pairing = false;
-    uint8_t deviceType = 0;
-    uint8_t transmissionType = 0; // 0x05;
-    if (!ant.setChannelId(channel, deviceNum, pairing, deviceType, transmissionType))
-    {
-        logStream << "Error setting channel ID";
-        logFlush();
-        ant.leave(channel);
-        return EXIT_FAILURE;
-    }
-
-    if (!ant.openChannel(channel))
+    ANTChannelProfile profile;
+    profile.network = 0;
+    profile.networkKey.assign(netKey, netKey+sizeof(netKey));
+    profile.type = ReceiveChannel;
+    profile.period = 4096; // period = 32768 / 8,00 Hz = 4096
+    profile.searchTimeout = 0xFF; // timeout = N / 2.5s, 0x00 = immediate, 0xFF = unlimited
+    profile.frequency = 50; // 2400 Mhz + 50 Mhz = 2450 Mhz (ANTFS)
+    profile.searchWaveform = 83;
+    profile.deviceNum = 0;
+    profile.pairing = false;
+    profile.deviceType = 0;
+    profile.transmissionType = 0; // 0x05;
+
+    if (!ant.openChannel(channel, profile))
     {
         logStream << "Error opening channel";
         logFlush();
@@ -247,31 +154,19 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    if (!ant.requestMessage(channel, MSG_ChannelStatus))
+    if (!ant.waitChannelStatus(channel, ChannelStatusSearching))
     {
-        logStream << "Error requesting channel status";
+        logStream << "Error waiting for channel to search";
         logFlush();
         ant.leave(channel);
         return EXIT_FAILURE;
     }
 
-    channelStatus = 0;
-    do
-    {
-        if (!ant.getChannelStatus(channelStatus))
-        {
-            logStream << "Error getting channel status";
-            logFlush();
-            ant.leave(channel);
-            return EXIT_FAILURE;
-        }
-        logStream << "Channel Status: " << ant.channelStatusMap[(unsigned)channelStatus] << "(" << (unsigned)channelStatus << ")";
-        logFlush();
-    }
-    while(channelStatus != ChannelStatusSearching);
-        
+    logStream << "Channel Status: " << ant.getChannelStatusString();
+    logFlush();
+
     uint8_t beaconPeriod = 4;
-    if (!ant.link(channel, frequency, beaconPeriod, HOSTSN))
+    if (!ant.link(channel, profile.frequency, beaconPeriod, HOSTSN))
     {
         logStream << "Error establishing link";
         logFlush();
@@ -334,7 +229,28 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    // Interrupted activity downloads continue from here in the next session
+    ant.setCheckpointDirectory("partial");
+
     vector<uint8_t> data;
+
+    // Most polls find nothing new: fetch just the directory header first and
+    // stop if the directory has not changed since the last complete sync
+    uint32_t syncedDirectoryTime;
+    if (catalog.directoryTime(unitId, syncedDirectoryTime) &&
+        ant.downloadHead(channel, 0, sizeof(DirectoryHeader), data) && data.size() >= sizeof(DirectoryHeader))
+    {
+        DirectoryHeader directoryHeader;
+        memcpy(&directoryHeader, &data.front(), sizeof(directoryHeader));
+        if (directoryHeader.directoryModifiedTime == syncedDirectoryTime)
+        {
+            logStream << "# Directory unchanged since the last sync, nothing to do.";
+            logFlush();
+            ant.leave(channel);
+            return EXIT_SUCCESS;
+        }
+    }
+
     if (!ant.download(channel, 0, data))
     {
         logStream << "Error downloading ANTFS directory";
@@ -347,6 +263,9 @@ int main(int argc, char *argv[])
     ZeroFileContent zeroFileContent;
     fit.parseZeroFile(data, zeroFileContent);
 
+    // Lists written by older versions only know file indices:
+    catalog.importLegacy("activities.dat", unitId, zeroFileContent);
+
 
     logStream << "# " << dec << zeroFileContent.activityFiles.size() << " activity files available.";
     logFlush();
@@ -361,7 +280,7 @@ int main(int argc, char *argv[])
 	continue;
 
       // UPDATE mode: Only download unknown activities:
-      if (clOpt.isSet('u') && std::find(numbers.begin(), numbers.end(), zeroFileContent.activityFiles[i]) != numbers.end())
+      if (clOpt.isSet('u') && catalog.contains(catalogEntry(unitId, zeroFileContent.records[zeroFileContent.activityFiles[i]])))
 	continue;
 
       filelist.push_back(zeroFileContent.activityFiles[i]);
@@ -371,33 +290,72 @@ int main(int argc, char *argv[])
     logStream << "# " << dec << filelist.size() << " activity files to be downloaded.";
     logFlush();
 
-    // Prepare file for logging downloaded activities:
-    ofstream output;
-    output.open("activities.dat", ios::out | ios::app );
+    // Activities are parsed while they download and exported in the
+    // background (and added to the catalog) while the next one is
+    // transferred:
+    ExportPipeline pipeline(catalog, EXPORT_QUEUE_SIZE, EXPORT_WORKERS);
+    if (!pipeline.start())
+    {
+        ant.leave(channel);
+        return EXIT_FAILURE;
+    }
 
     for (int i=0; i<filelist.size();i++) {
-      GPX gpx;
       logStream << "# Transfer activity file 0x" << hex << (int)filelist[i] 
 		<< " (" << dec << i << "/" << dec << filelist.size() << ")";
       logFlush();
       
-      if (!ant.download(channel, filelist[i], data))
+      const ZeroFileRecord &record = zeroFileContent.records[filelist[i]];
+
+      // A file the watch appended to since the last sync only needs its
+      // tail, if the start is still archived here. The watch refuses the
+      // tail when the start does not match its copy, and the tail is only
+      // kept if every byte decodes as FIT; otherwise fetch it all.
+      ActivityParser tailParser(fit), fullParser(fit);
+      ActivityParser *parser = &fullParser;
+      CatalogEntry last;
+      uint16_t lastCRC;
+      if (record.generalFileFlags.append && catalog.previous(unitId, record.index, last, lastCRC) &&
+          last.fileSize < record.fileSize && ExportPipeline::loadArchive(last, lastCRC, data))
+      {
+        if (ant.downloadTail(channel, filelist[i], data, record.timeStamp, record.fileSize, &tailParser))
+        {
+          if (tailParser.finish() && tailParser.decodedSize() == data.size())
+            parser = &tailParser;
+          else {
+            logStream << "Tail of activity file 0x" << hex << (int)filelist[i]
+                      << " decoded " << dec << tailParser.decodedSize() << "/" << data.size()
+                      << " bytes, downloading it in full";
+            logFlush();
+          }
+        }
+      }
+
+      if (parser == &fullParser && !ant.download(channel, filelist[i], data, record.timeStamp, record.fileSize, &fullParser))
 	break;
 
-      if (data.size() >= sizeof(FITHeader))
-	fit.parse(data, gpx);
-      
-      // Store the track immediately:
-      stringstream sstm;
-      sstm << "activities/track" << (int)filelist[i] << ".gpx";
-      gpx.writeToFile(sstm.str());
+      if (!parser->finish())
+      {
+        logStream << "Error parsing activity file 0x" << hex << (int)filelist[i];
+        logFlush();
+      }
 
-      // This activity has been received, store that information:
-      output << (int)filelist[i] << endl;
-      
+      uint16_t crc = data.empty() ? 0 : CRC16::update(0, &data.front(), data.size());
+      pipeline.push(catalogEntry(unitId, record), parser->gpx, crc, record.generalFileFlags.append ? &data : NULL);
+    }
+
+    pipeline.finish();
+
+    // Only a directory that is completely in the catalog may short-circuit
+    // the next sync
+    bool complete = true;
+    for (int i=0; i<zeroFileContent.activityFiles.size() && complete; i++) {
+      complete = catalog.contains(catalogEntry(unitId, zeroFileContent.records[zeroFileContent.activityFiles[i]]));
     }
+    if (complete)
+      catalog.setDirectoryTime(unitId, zeroFileContent.header.directoryModifiedTime);
 
-    output.close();
+    catalog.commit();
       
     logStream << "# Done with donwloading...";
     logFlush();
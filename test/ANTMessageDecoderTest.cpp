@@ -0,0 +1,138 @@
+/***************************************************************************
+ *   Copyright (C) 2010-2012 by Oleg Khudyakov                             *
+ *   prcoder@gmail.com                                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "ANT.h"
+#include "Check.h"
+
+#include <vector>
+
+using namespace std;
+
+struct DecodedFrame
+{
+    ANT_Message id;
+    vector<uint8_t> data;
+};
+
+static void appendFrame(vector<uint8_t> &stream, uint8_t id, const vector<uint8_t> &data)
+{
+    size_t start = stream.size();
+    stream.push_back(ANTMessage::RXSync);
+    stream.push_back(data.size());
+    stream.push_back(id);
+    stream.insert(stream.end(), data.begin(), data.end());
+
+    uint8_t crc = 0;
+    for (size_t i = start; i < stream.size(); i++)
+    {
+        crc ^= stream[i];
+    }
+    stream.push_back(crc);
+}
+
+// Pushes the stream through the decoder in chunks of the given size
+static vector<DecodedFrame> decodeAll(ANTMessageDecoder &decoder, const vector<uint8_t> &stream, size_t chunk)
+{
+    vector<DecodedFrame> frames;
+    for (size_t pos = 0; pos < stream.size(); pos += chunk)
+    {
+        const uint8_t *ptr = &stream[pos];
+        size_t len = min(chunk, stream.size() - pos);
+        for (;;)
+        {
+            size_t consumed = 0;
+            ANTMessageDecoder::Result result = decoder.decode(ptr, len, consumed);
+            ptr += consumed;
+            len -= consumed;
+            if (result == ANTMessageDecoder::DecodeIncomplete)
+            {
+                break;
+            }
+            if (result == ANTMessageDecoder::DecodeComplete)
+            {
+                DecodedFrame frame;
+                frame.id = decoder.getMessageId();
+                frame.data.assign(decoder.getMessageData(), decoder.getMessageData() + decoder.getMessageLength());
+                frames.push_back(frame);
+            }
+        }
+    }
+
+    return frames;
+}
+
+int main()
+{
+    uint8_t event[] = { 0, MSG_ChannelEvent, EventTransferTXCompleted };
+    uint8_t status[] = { 0, ChannelStatusTracking };
+    uint8_t burst[] = { 0x20, 1, 2, 3, 4, 5, 6, 7, 8 };
+
+    vector<uint8_t> stream;
+    // Line noise ahead of the first frame
+    stream.push_back(0x00);
+    stream.push_back(0x55);
+    appendFrame(stream, MSG_ResponseEvent, vector<uint8_t>(event, event + sizeof(event)));
+
+    // A frame with a bad checksum whose payload holds a complete frame: the
+    // decoder has to find it by rescanning after the bad frame's sync byte
+    vector<uint8_t> inner;
+    appendFrame(inner, MSG_ChannelStatus, vector<uint8_t>(status, status + sizeof(status)));
+    size_t corrupted = stream.size();
+    appendFrame(stream, MSG_SendBroadcastData, inner);
+    stream.back() ^= 0xFF;
+
+    // A length no ANT device sends, followed straight by a good frame
+    stream.push_back(ANTMessage::RXSync);
+    stream.push_back(Max_Message_Length + 1);
+    appendFrame(stream, MSG_SendBurstTransferPacket, vector<uint8_t>(burst, burst + sizeof(burst)));
+
+    size_t chunks[] = { 1, 2, 3, 7, stream.size() };
+    for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++)
+    {
+        ANTMessageDecoder decoder;
+        vector<DecodedFrame> frames = decodeAll(decoder, stream, chunks[i]);
+
+        CHECK(frames.size() == 3);
+        if (frames.size() == 3)
+        {
+            CHECK(frames[0].id == MSG_ResponseEvent);
+            CHECK(frames[0].data == vector<uint8_t>(event, event + sizeof(event)));
+            CHECK(frames[1].id == MSG_ChannelStatus);
+            CHECK(frames[1].data == vector<uint8_t>(status, status + sizeof(status)));
+            CHECK(frames[2].id == MSG_SendBurstTransferPacket);
+            CHECK(frames[2].data == vector<uint8_t>(burst, burst + sizeof(burst)));
+        }
+
+        ANTDecoderStatistics stats = decoder.getStatistics();
+        CHECK(stats.frames == 3);
+        CHECK(stats.checksumErrors == 1);
+        CHECK(stats.lengthErrors == 1);
+    }
+
+    // A reset drops a half decoded frame along with the statistics
+    ANTMessageDecoder decoder;
+    decodeAll(decoder, vector<uint8_t>(stream.begin(), stream.begin() + corrupted + 4), stream.size());
+    decoder.reset();
+    ANTDecoderStatistics stats = decoder.getStatistics();
+    CHECK(stats.frames == 0 && stats.checksumErrors == 0 && stats.lengthErrors == 0);
+    CHECK(decodeAll(decoder, stream, 4).size() == 3);
+
+    return CHECK_STATUS();
+}
@@ -0,0 +1,86 @@
+/***************************************************************************
+ *   Copyright (C) 2010-2012 by Oleg Khudyakov                             *
+ *   prcoder@gmail.com                                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "CRC16.h"
+#include "Check.h"
+
+#include <string.h>
+#include <vector>
+
+using namespace std;
+
+// Bit by bit CRC-16/ARC, the definition the tables are checked against
+static uint16_t referenceCRC(uint16_t crc, const uint8_t *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+        }
+    }
+
+    return crc;
+}
+
+int main()
+{
+    // Standard check value of CRC-16/ARC
+    const char *check = "123456789";
+    CHECK(CRC16::update(0, (const uint8_t *)check, strlen(check)) == 0xBB3D);
+
+    // Every table entry, through the single byte update
+    for (unsigned crc = 0; crc < 0x10000; crc += 0x0101)
+    {
+        for (unsigned byte = 0; byte < 256; byte++)
+        {
+            uint8_t b = byte;
+            CHECK(CRC16::update(crc, b) == referenceCRC(crc, &b, 1));
+        }
+    }
+
+    // Slice-by-8 over all lengths and alignments, whole and in pieces
+    vector<uint8_t> data(1024);
+    uint32_t seed = 1;
+    for (size_t i = 0; i < data.size(); i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        data[i] = seed >> 16;
+    }
+
+    for (size_t offset = 0; offset < 8; offset++)
+    {
+        for (size_t len = 0; len + offset <= 100; len++)
+        {
+            CHECK(CRC16::update(0x1234, &data[offset], len) == referenceCRC(0x1234, &data[offset], len));
+        }
+    }
+
+    uint16_t whole = CRC16::update(0, &data.front(), data.size());
+    CHECK(whole == referenceCRC(0, &data.front(), data.size()));
+    for (size_t split = 0; split <= data.size(); split += 37)
+    {
+        uint16_t crc = CRC16::update(0, &data.front(), split);
+        CHECK(CRC16::update(crc, &data.front() + split, data.size() - split) == whole);
+    }
+
+    return CHECK_STATUS();
+}
@@ -0,0 +1,178 @@
+/***************************************************************************
+ *   Copyright (C) 2010-2012 by Oleg Khudyakov                             *
+ *   prcoder@gmail.com                                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "Catalog.h"
+#include "FIT.h"
+#include "Check.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fstream>
+
+using namespace std;
+
+static CatalogEntry makeEntry(uint32_t unitId, uint16_t fileIndex, uint32_t timeStamp, uint32_t fileSize)
+{
+    CatalogEntry entry = { unitId, fileIndex, timeStamp, fileSize };
+    return entry;
+}
+
+static size_t onDisk(const string &fileName)
+{
+    Catalog catalog(fileName);
+    catalog.load();
+    return catalog.size();
+}
+
+int main()
+{
+    char dir[] = "/tmp/ganthem-catalog-XXXXXX";
+    if (!mkdtemp(dir))
+    {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    string fileName = string(dir) + "/catalog";
+
+    {
+        Catalog catalog(fileName, 4);
+        CHECK(!catalog.load());
+
+        // Written out in batches, a duplicate does not count towards one
+        for (uint16_t i = 0; i < 3; i++)
+        {
+            catalog.add(makeEntry(3900000000U, i, 1000 + i, 4096 * (i + 1)));
+        }
+        catalog.add(makeEntry(3900000000U, 0, 1000, 4096));
+        CHECK(catalog.size() == 3);
+        CHECK(onDisk(fileName) == 0);
+
+        catalog.add(makeEntry(3900000000U, 3, 1003, 4096 * 4));
+        CHECK(onDisk(fileName) == 4);
+
+        for (uint16_t i = 4; i < 9; i++)
+        {
+            catalog.add(makeEntry(3900000000U, i, 1000 + i, 4096 * (i + 1)));
+        }
+        // The same index reused for a newer file, and another unit
+        catalog.add(makeEntry(3900000000U, 5, 2000, 100));
+        catalog.add(makeEntry(12345, 2, 500, 300));
+        CHECK(catalog.size() == 11);
+        CHECK(onDisk(fileName) == 8);
+
+        catalog.setDirectoryTime(3900000000U, 777);
+    }
+    CHECK(onDisk(fileName) == 11);
+
+    {
+        Catalog catalog(fileName);
+        CHECK(catalog.load());
+
+        for (uint16_t i = 0; i < 9; i++)
+        {
+            CHECK(catalog.contains(makeEntry(3900000000U, i, 1000 + i, 4096 * (i + 1))));
+        }
+        CHECK(!catalog.contains(makeEntry(3900000000U, 9, 1009, 4096 * 10)));
+        CHECK(catalog.contains(makeEntry(3900000000U, 5, 2000, 100)));
+        CHECK(catalog.contains(makeEntry(12345, 2, 500, 300)));
+        CHECK(!catalog.contains(makeEntry(3900000000U, 1, 1001, 4097)));
+        CHECK(!catalog.contains(makeEntry(3900000001U, 1, 1001, 8192)));
+        CHECK(!catalog.contains(makeEntry(12345, 2, 501, 300)));
+
+        uint32_t modifiedTime = 0;
+        CHECK(catalog.directoryTime(3900000000U, modifiedTime) && modifiedTime == 777);
+        CHECK(!catalog.directoryTime(12345, modifiedTime));
+    }
+    // The latest version of each index is remembered with its CRC, also
+    // across a reload
+    {
+        Catalog catalog(fileName, 1);
+        CHECK(catalog.load());
+        catalog.add(makeEntry(3900000000U, 2, 1002, 65536), 0xBEEF);
+        catalog.add(makeEntry(3900000000U, 1, 1001, 8192), 0xA001);
+    }
+    {
+        Catalog catalog(fileName);
+        CHECK(catalog.load());
+        CHECK(catalog.size() == 12);
+
+        CatalogEntry entry;
+        uint16_t crc;
+        CHECK(catalog.previous(3900000000U, 1, entry, crc));
+        CHECK(entry == makeEntry(3900000000U, 1, 1001, 8192) && crc == 0xA001);
+        CHECK(catalog.previous(3900000000U, 2, entry, crc));
+        CHECK(entry == makeEntry(3900000000U, 2, 1002, 65536) && crc == 0xBEEF);
+        CHECK(catalog.previous(3900000000U, 5, entry, crc));
+        CHECK(entry == makeEntry(3900000000U, 5, 2000, 100) && crc == 0);
+        CHECK(!catalog.previous(12345, 3, entry, crc));
+    }
+
+    // Catalogs written before CRCs were kept load with a zero CRC
+    {
+        ofstream file(fileName.c_str(), ios::out | ios::trunc);
+        file << "F 1 2 3 4" << endl << "D 1 5" << endl;
+    }
+    {
+        Catalog catalog(fileName);
+        CHECK(catalog.load());
+        CatalogEntry entry;
+        uint16_t crc = 1;
+        CHECK(catalog.previous(1, 2, entry, crc));
+        CHECK(entry == makeEntry(1, 2, 3, 4) && crc == 0);
+    }
+    unlink(fileName.c_str());
+
+    // The old list of indices maps onto the files the directory lists now
+    {
+        string legacyName = string(dir) + "/activities.dat";
+        {
+            ofstream legacy(legacyName.c_str(), ios::out | ios::trunc);
+            legacy << "7" << endl << "9" << endl << "11" << endl;
+        }
+
+        ZeroFileContent directory;
+        for (uint16_t i = 7; i < 10; i++)
+        {
+            ZeroFileRecord record = ZeroFileRecord();
+            record.index = i;
+            record.timeStamp = 5000 + i;
+            record.fileSize = 100 * i;
+            directory.records[i] = record;
+        }
+
+        Catalog catalog(fileName);
+        catalog.importLegacy(legacyName, 42, directory);
+        CHECK(catalog.size() == 2);
+        CHECK(catalog.contains(makeEntry(42, 7, 5007, 700)));
+        CHECK(catalog.contains(makeEntry(42, 9, 5009, 900)));
+        CHECK(!catalog.contains(makeEntry(42, 8, 5008, 800)));
+        CHECK(access(legacyName.c_str(), F_OK) != 0);
+        CHECK(onDisk(fileName) == 2);
+
+        unlink((legacyName + ".migrated").c_str());
+    }
+
+    unlink(fileName.c_str());
+    unlink((fileName + ".tmp").c_str());
+    rmdir(dir);
+
+    return CHECK_STATUS();
+}
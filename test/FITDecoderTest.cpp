@@ -0,0 +1,244 @@
+/***************************************************************************
+ *   Copyright (C) 2010-2012 by Oleg Khudyakov                             *
+ *   prcoder@gmail.com                                                     *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "FIT.h"
+#include "CRC16.h"
+#include "Check.h"
+
+#include <stdlib.h>
+#include <map>
+#include <vector>
+
+using namespace std;
+
+struct Point
+{
+    int32_t latitude;
+    int32_t longitude;
+    uint16_t altitude;
+    uint8_t heartRate;
+};
+
+// Writes activity files in either byte order. Records come with a full
+// timestamp every ten points and a compressed timestamp header in between.
+class FITWriter
+{
+public:
+    FITWriter(bool bigEndian) : bigEndian(bigEndian) {}
+
+    vector<uint8_t> activity(uint32_t start, unsigned count, map<uint32_t, Point> &points)
+    {
+        records.clear();
+
+        static const uint8_t fileIdFields[] = { 0, 1, 0x00, 4, 4, 0x86 };
+        static const uint8_t recordFields[] = { 253, 4, 0x86, 0, 4, 0x85, 1, 4, 0x85, 2, 2, 0x84, 3, 1, 0x02 };
+        define(0, 0, fileIdFields, sizeof(fileIdFields));
+        define(1, 20, recordFields, sizeof(recordFields));
+        define(2, 20, recordFields + 3, sizeof(recordFields) - 3);
+
+        records.push_back(0x00);
+        put(4, 1);
+        put(start, 4);
+
+        uint32_t time = start;
+        for (unsigned i = 0; i < count; i++)
+        {
+            time += 1 + rand() % 20;
+            Point point = { (int32_t)(rand() - RAND_MAX / 2), (int32_t)(rand() - RAND_MAX / 2),
+                (uint16_t)rand(), (uint8_t)rand() };
+            points[time] = point;
+
+            if (i % 10 == 0)
+            {
+                records.push_back(0x01);
+                put(time, 4);
+            }
+            else
+            {
+                records.push_back(0x80 | (2 << 5) | (time & 0x1F));
+            }
+            put(point.latitude, 4);
+            put(point.longitude, 4);
+            put(point.altitude, 2);
+            put(point.heartRate, 1);
+        }
+
+        return wrap();
+    }
+
+    // A file whose only record is a data message of a local type never defined
+    vector<uint8_t> undefined()
+    {
+        records.clear();
+        records.push_back(0x05);
+        put(0, 4);
+
+        return wrap();
+    }
+
+private:
+    // Adds the file header and the CRCs around the records
+    vector<uint8_t> wrap()
+    {
+        vector<uint8_t> file;
+        uint8_t header[] = { 14, 0x10, 100, 0,
+            (uint8_t)records.size(), (uint8_t)(records.size() >> 8), (uint8_t)(records.size() >> 16), (uint8_t)(records.size() >> 24),
+            '.', 'F', 'I', 'T' };
+        file.assign(header, header + sizeof(header));
+        uint16_t crc = CRC16::update(0, &file.front(), file.size());
+        file.push_back(crc);
+        file.push_back(crc >> 8);
+        file.insert(file.end(), records.begin(), records.end());
+        crc = CRC16::update(0, &file.front(), file.size());
+        file.push_back(crc);
+        file.push_back(crc >> 8);
+
+        return file;
+    }
+
+    void define(uint8_t localType, uint16_t globalNum, const uint8_t fields[], size_t len)
+    {
+        records.push_back(0x40 | localType);
+        records.push_back(0);
+        records.push_back(bigEndian ? ArchitectureBigEndian : ArchitectureLittleEndian);
+        put(globalNum, 2);
+        records.push_back(len / 3);
+        records.insert(records.end(), fields, fields + len);
+    }
+
+    void put(uint32_t value, unsigned size)
+    {
+        for (unsigned i = 0; i < size; i++)
+        {
+            unsigned shift = bigEndian ? (size - 1 - i) * 8 : i * 8;
+            records.push_back(value >> shift);
+        }
+    }
+
+    bool bigEndian;
+    vector<uint8_t> records;
+};
+
+static bool sameTrack(const Track &track, const map<uint32_t, Point> &points)
+{
+    const map<uint32_t, TrackPoint> &decoded = track.trackSegs.back().trackPoints;
+    if (decoded.size() != points.size())
+    {
+        return false;
+    }
+
+    map<uint32_t, TrackPoint>::const_iterator it = decoded.begin();
+    map<uint32_t, Point>::const_iterator expected = points.begin();
+    for (; it != decoded.end(); ++it, ++expected)
+    {
+        if (it->first != expected->first || it->second.time != expected->first ||
+            it->second.latitude != expected->second.latitude || it->second.longitude != expected->second.longitude ||
+            it->second.altitude != expected->second.altitude || it->second.heartRate != expected->second.heartRate)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Feeds the data in random chunks of up to maxChunk bytes
+static bool decodeChunked(FIT &fit, const vector<uint8_t> &data, size_t maxChunk, GPX &gpx, size_t &decodedSize)
+{
+    FITDecoder decoder(fit, gpx);
+    bool rv = true;
+    for (size_t pos = 0; pos < data.size() && rv; )
+    {
+        size_t len = min(data.size() - pos, 1 + rand() % maxChunk);
+        rv = decoder.feed(&data[pos], len);
+        pos += len;
+    }
+    decodedSize = decoder.decodedSize();
+
+    return decoder.finish() && rv;
+}
+
+int main()
+{
+    srand(1);
+    FIT fit;
+
+    for (int bigEndian = 0; bigEndian < 2; bigEndian++)
+    {
+        FITWriter writer(bigEndian);
+        map<uint32_t, Point> first, second;
+        vector<uint8_t> file = writer.activity(900000000, 500, first);
+
+        GPX whole;
+        CHECK(fit.parse(file, whole));
+        CHECK(whole.tracks.size() == 1 && sameTrack(whole.tracks[0], first));
+
+        size_t chunks[] = { 1, 3, 16, 100, file.size() };
+        for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++)
+        {
+            GPX gpx;
+            size_t decodedSize = 0;
+            CHECK(decodeChunked(fit, file, chunks[i], gpx, decodedSize));
+            CHECK(decodedSize == file.size());
+            CHECK(gpx.tracks.size() == 1 && sameTrack(gpx.tracks[0], first));
+        }
+
+        // Chained files decode one after the other, each into its own track
+        vector<uint8_t> chained = file;
+        vector<uint8_t> next = writer.activity(950000000, 300, second);
+        chained.insert(chained.end(), next.begin(), next.end());
+        {
+            GPX gpx;
+            size_t decodedSize = 0;
+            CHECK(decodeChunked(fit, chained, 64, gpx, decodedSize));
+            CHECK(decodedSize == chained.size());
+            CHECK(gpx.tracks.size() == 2 && sameTrack(gpx.tracks[0], first) && sameTrack(gpx.tracks[1], second));
+        }
+
+        // A truncated file is reported, only the complete one counts
+        {
+            GPX gpx;
+            size_t decodedSize = 0;
+            vector<uint8_t> truncated(chained.begin(), chained.end() - 10);
+            CHECK(!decodeChunked(fit, truncated, 64, gpx, decodedSize));
+            CHECK(decodedSize == file.size());
+        }
+
+        // So is a bad CRC
+        {
+            GPX gpx;
+            size_t decodedSize = 0;
+            vector<uint8_t> corrupted = file;
+            corrupted[corrupted.size() / 2] ^= 0x01;
+            CHECK(!decodeChunked(fit, corrupted, 64, gpx, decodedSize));
+            CHECK(decodedSize == 0);
+        }
+
+        // Data messages only decode through a defined slot
+        {
+            GPX gpx;
+            size_t decodedSize = 0;
+            CHECK(!decodeChunked(fit, writer.undefined(), 64, gpx, decodedSize));
+            CHECK(decodedSize == 0);
+        }
+    }
+
+    return CHECK_STATUS();
+}